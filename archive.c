@@ -0,0 +1,995 @@
+/* archive.c - store the output of all jobs in a single file
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The archive is an alternative to the result directory for very many
+ * jobs.  The output of each job is captured in an in-memory file.
+ * Once the job has finished, its status, stdout and stderr are
+ * appended to the archive as one record, and the records are written
+ * to disk in large batches.  Large records bypass the batch and are
+ * copied from the buffers to the archive directly.  When the archive
+ * is closed, an index which maps command numbers to record offsets is
+ * appended, so that single records can be found with a binary search
+ * on disk.
+ *
+ * All numbers are stored in little-endian byte order.  The file
+ * starts with the 8 byte magic "PARARCH1".  A record starts with a 48
+ * byte header:
+ *
+ *     0  magic "REC1"
+ *     4  flags, bit 0 set if the data is compressed with zlib
+ *     8  command number
+ *    16  length of the status text
+ *    20  wait status of the job
+ *    24  length of stdout
+ *    32  length of stderr
+ *    40  length of the (possibly compressed) data
+ *
+ * The data is the status text, as in the status files of the result
+ * directory, followed by stdout and stderr.  The index consists of 16
+ * byte entries (command number, record offset), sorted by command
+ * number, and is followed by a 24 byte trailer: the offset of the
+ * index, the number of entries and the magic "PARINDX1".
+ *
+ * If parallel is interrupted, the archive has no index.  The records
+ * are then found by following the headers from the start of the file.
+ * An existing archive is reopened by removing the index (or any
+ * incomplete record at the end) and appending new records.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "parallel.h"
+
+
+#define FILE_MAGIC "PARARCH1"
+#define INDEX_MAGIC "PARINDX1"
+#define RECORD_MAGIC 0x31434552	/* "REC1" */
+#define FLAG_ZLIB 1
+
+#define HEADER_SIZE 48
+#define ENTRY_SIZE 16
+#define TRAILER_SIZE 24
+
+/* records are written once this much data has accumulated, ... */
+#define ARCHIVE_BATCH (4*1024*1024)
+/* ... or when the oldest record has waited this many seconds */
+#define ARCHIVE_DELAY 10.0
+/* records with more data than this are not batched */
+#define ARCHIVE_STREAM (256*1024)
+/* chunk size for compressing streamed records */
+#define STREAM_CHUNK 65536
+
+struct archive_entry {
+  uint64_t  cmd_no;
+  uint64_t  offset;
+};
+
+struct archive {
+  char *path;
+  int  fd;
+  int  compress;
+  int  failed;			/* a write error has been reported */
+  off_t  end;			/* file offset of the first unwritten byte */
+  unsigned char *buf;		/* records not yet written */
+  size_t  used, allocated;
+  double  first_pending;	/* when the oldest record in BUF was added */
+  unsigned char *scratch;	/* uncompressed data of one batched record,
+				   or the buffers for streaming */
+  size_t  scratch_allocated;
+  struct archive_entry *index;
+  long  n_index, index_allocated;
+};
+
+struct record {
+  uint32_t  flags;
+  uint64_t  cmd_no;
+  uint32_t  meta_len;
+  int32_t  status;
+  uint64_t  out_len, err_len;
+  uint64_t  data_len;
+};
+
+
+/**********************************************************************
+ * the file format
+ */
+
+static void
+put_u32(unsigned char *p, uint32_t x)
+{
+  int  i;
+
+  for (i=0; i<4; ++i)
+    p[i] = x >> (8*i);
+}
+
+static void
+put_u64(unsigned char *p, uint64_t x)
+{
+  int  i;
+
+  for (i=0; i<8; ++i)
+    p[i] = x >> (8*i);
+}
+
+static uint32_t
+get_u32(const unsigned char *p)
+{
+  uint32_t  x = 0;
+  int  i;
+
+  for (i=3; i>=0; --i)
+    x = (x << 8) | p[i];
+  return x;
+}
+
+static uint64_t
+get_u64(const unsigned char *p)
+{
+  uint64_t  x = 0;
+  int  i;
+
+  for (i=7; i>=0; --i)
+    x = (x << 8) | p[i];
+  return x;
+}
+
+static void
+encode_header(unsigned char *p, const struct record *rec)
+{
+  put_u32(p, RECORD_MAGIC);
+  put_u32(p+4, rec->flags);
+  put_u64(p+8, rec->cmd_no);
+  put_u32(p+16, rec->meta_len);
+  put_u32(p+20, rec->status);
+  put_u64(p+24, rec->out_len);
+  put_u64(p+32, rec->err_len);
+  put_u64(p+40, rec->data_len);
+}
+
+static int
+decode_header(const unsigned char *p, struct record *rec)
+/* Return 0 if P holds a record header and -1 otherwise.  */
+{
+  if (get_u32(p) != RECORD_MAGIC)
+    return -1;
+  rec->flags = get_u32(p+4);
+  rec->cmd_no = get_u64(p+8);
+  rec->meta_len = get_u32(p+16);
+  rec->status = get_u32(p+20);
+  rec->out_len = get_u64(p+24);
+  rec->err_len = get_u64(p+32);
+  rec->data_len = get_u64(p+40);
+  return 0;
+}
+
+static int
+read_at(int fd, void *buf, size_t len, off_t offset)
+/* Read exactly LEN bytes at OFFSET.  Return 0 on success and -1 on
+ * error or at the end of the file.  */
+{
+  ssize_t  n;
+
+  while (len > 0) {
+    n = pread(fd, buf, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf = (char *)buf + n;
+    len -= n;
+    offset += n;
+  }
+  return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+  ssize_t  n;
+
+  while (len > 0) {
+    n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    buf = (const char *)buf + n;
+    len -= n;
+  }
+  return 0;
+}
+
+static void
+add_entry(struct archive *ar, uint64_t cmd_no, uint64_t offset)
+{
+  if (ar->n_index == ar->index_allocated) {
+    ar->index_allocated = ar->index_allocated ? 2*ar->index_allocated : 1024;
+    ar->index = xrenew(struct archive_entry, ar->index,
+		       ar->index_allocated);
+  }
+  ar->index[ar->n_index].cmd_no = cmd_no;
+  ar->index[ar->n_index].offset = offset;
+  ++ar->n_index;
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+  const struct archive_entry *x = a, *y = b;
+
+  if (x->cmd_no != y->cmd_no)
+    return x->cmd_no < y->cmd_no ? -1 : 1;
+  return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static off_t
+scan_records(int fd, off_t size, struct archive *ar)
+/* Add all complete records of the archive FD, which has SIZE bytes,
+ * to the index of AR.  Return the offset just after the last complete
+ * record.  */
+{
+  unsigned char  header[HEADER_SIZE];
+  struct record  rec;
+  off_t  pos = sizeof(FILE_MAGIC)-1;
+
+  while (pos + HEADER_SIZE <= size) {
+    if (read_at(fd, header, HEADER_SIZE, pos) < 0
+	|| decode_header(header, &rec) < 0
+	|| rec.data_len > (uint64_t)(size - pos - HEADER_SIZE))
+      break;
+    add_entry(ar, rec.cmd_no, pos);
+    pos += HEADER_SIZE + rec.data_len;
+  }
+  return pos;
+}
+
+static int
+read_trailer(int fd, off_t size, off_t *index_p, uint64_t *n_p)
+/* Find the index of the archive FD, which has SIZE bytes.  Return 0
+ * on success and -1 if the archive has no index.  */
+{
+  unsigned char  trailer[TRAILER_SIZE];
+  uint64_t  index, n;
+
+  if (size < (off_t)(sizeof(FILE_MAGIC)-1 + TRAILER_SIZE)
+      || read_at(fd, trailer, TRAILER_SIZE, size - TRAILER_SIZE) < 0
+      || memcmp(trailer+16, INDEX_MAGIC, 8) != 0)
+    return -1;
+  index = get_u64(trailer);
+  n = get_u64(trailer+8);
+  if (index < sizeof(FILE_MAGIC)-1
+      || index + n*ENTRY_SIZE + TRAILER_SIZE != (uint64_t)size)
+    return -1;
+  *index_p = index;
+  *n_p = n;
+  return 0;
+}
+
+
+/**********************************************************************
+ * writing the archive
+ */
+
+int
+new_buffer_file(void)
+/* Return a file descriptor for an anonymous file, preferably held in
+ * memory.  */
+{
+  char *path;
+  const char *tmpdir;
+  int  fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create("parallel-buffer", MFD_CLOEXEC);
+  if (fd >= 0 || errno != ENOSYS)
+    return fd;
+#endif
+  tmpdir = getenv("TMPDIR");
+  asprintf(&path, "%s/parallel.XXXXXX", tmpdir ? tmpdir : "/tmp");
+  fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  }
+  free(path);
+  return fd;
+}
+
+static int
+flush_archive(struct archive *ar)
+{
+  if (ar->used == 0 || ar->failed)
+    return ar->failed ? -1 : 0;
+  if (write_all(ar->fd, ar->buf, ar->used) < 0) {
+    error("error: cannot write archive \"%s\" (%m)", ar->path);
+    ar->failed = 1;
+    return -1;
+  }
+  ar->end += ar->used;
+  ar->used = 0;
+  return 0;
+}
+
+struct archive *
+open_archive(const char *path, int compress)
+/* Open the archive PATH for appending, or create it if it does not
+ * exist.  If COMPRESS is set, the records are compressed where this
+ * saves space.  On error, a message is emitted and NULL is returned.  */
+{
+  struct archive *ar;
+  char  magic[sizeof(FILE_MAGIC)-1];
+  struct stat  st;
+  uint64_t  n, i;
+  off_t  index;
+  int  fd;
+
+  fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0666);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    error("error: cannot open archive \"%s\" (%m)", path);
+    if (fd >= 0)
+      close(fd);
+    return NULL;
+  }
+#ifndef HAVE_ZLIB
+  if (compress) {
+    warning("warning: compression is not available");
+    compress = 0;
+  }
+#endif
+
+  ar = xnew(struct archive, 1);
+  memset(ar, 0, sizeof(struct archive));
+  ar->path = xstrdup(path);
+  ar->fd = fd;
+  ar->compress = compress;
+
+  if (st.st_size == 0) {
+    if (write_all(fd, FILE_MAGIC, sizeof(magic)) < 0) {
+      error("error: cannot write archive \"%s\" (%m)", path);
+      goto fail;
+    }
+    ar->end = sizeof(magic);
+    return ar;
+  }
+
+  if (read_at(fd, magic, sizeof(magic), 0) < 0
+      || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0) {
+    error("error: \"%s\" is not an archive", path);
+    goto fail;
+  }
+  if (read_trailer(fd, st.st_size, &index, &n) == 0) {
+    unsigned char  entry[ENTRY_SIZE];
+    for (i=0; i<n; ++i) {
+      if (read_at(fd, entry, ENTRY_SIZE, index + i*ENTRY_SIZE) < 0) {
+	error("error: cannot read archive \"%s\" (%m)", path);
+	goto fail;
+      }
+      add_entry(ar, get_u64(entry), get_u64(entry+8));
+    }
+    ar->end = index;
+  } else {
+    ar->end = scan_records(fd, st.st_size, ar);
+    if (ar->end < st.st_size)
+      warning("warning: discarding %lld bytes of incomplete data at the"
+	      " end of \"%s\"", (long long)(st.st_size - ar->end), path);
+  }
+  /* new records replace the index */
+  if (ftruncate(fd, ar->end) < 0 || lseek(fd, ar->end, SEEK_SET) < 0) {
+    error("error: cannot truncate archive \"%s\" (%m)", path);
+    goto fail;
+  }
+  return ar;
+
+ fail:
+  close(fd);
+  xfree(ar->index);
+  xfree(ar->path);
+  xfree(ar);
+  return NULL;
+}
+
+void
+close_archive(struct archive *ar)
+/* Write all pending records and the index, and free AR.  */
+{
+  unsigned char *p;
+  long  i;
+
+  flush_archive(ar);
+  qsort(ar->index, ar->n_index, sizeof(struct archive_entry),
+	compare_entries);
+  if (ar->n_index*ENTRY_SIZE + TRAILER_SIZE > ar->allocated) {
+    ar->allocated = ar->n_index*ENTRY_SIZE + TRAILER_SIZE;
+    ar->buf = xrenew(unsigned char, ar->buf, ar->allocated);
+  }
+  for (i=0, p=ar->buf; i<ar->n_index; ++i, p+=ENTRY_SIZE) {
+    put_u64(p, ar->index[i].cmd_no);
+    put_u64(p+8, ar->index[i].offset);
+  }
+  put_u64(p, ar->end);
+  put_u64(p+8, ar->n_index);
+  memcpy(p+16, INDEX_MAGIC, 8);
+  ar->used = ar->n_index*ENTRY_SIZE + TRAILER_SIZE;
+  flush_archive(ar);
+
+  if (close(ar->fd) < 0 && ! ar->failed)
+    error("error: cannot write archive \"%s\" (%m)", ar->path);
+  xfree(ar->scratch);
+  xfree(ar->index);
+  xfree(ar->buf);
+  xfree(ar->path);
+  xfree(ar);
+}
+
+int
+archive_prepare(struct archive *ar, struct job *job)
+/* Open the buffers which capture the output of JOB.  Return 0 on
+ * success and -1 on error.  */
+{
+  job->result_out = new_buffer_file();
+  job->result_err = new_buffer_file();
+  if (job->result_out >= 0 && job->result_err >= 0)
+    return 0;
+
+  error("error: cannot capture output of command %ld (%m)", job->cmd_no);
+  if (job->result_out >= 0)  close(job->result_out);
+  if (job->result_err >= 0)  close(job->result_err);
+  job->result_out = job->result_err = -1;
+  return -1;
+}
+
+static size_t
+read_buffer(int *fd_p, unsigned char *buf, size_t len)
+/* Copy the captured output in *FD_P to BUF and close the buffer.
+ * Return the number of bytes copied.  */
+{
+  size_t  done = 0;
+  ssize_t  n;
+
+  if (*fd_p < 0)
+    return 0;
+  while (done < len) {
+    n = pread(*fd_p, buf+done, len-done, done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  close(*fd_p);
+  *fd_p = -1;
+  return done;
+}
+
+static off_t
+buffer_size(int fd)
+{
+  struct stat  st;
+
+  if (fd < 0 || fstat(fd, &st) < 0)
+    return 0;
+  return st.st_size;
+}
+
+static off_t
+archive_pos(struct archive *ar)
+{
+  return lseek(ar->fd, 0, SEEK_CUR);
+}
+
+static int
+stream_raw(struct archive *ar, struct record *rec, const char *meta,
+	   int *out_p, int *err_p)
+/* Write the data of REC uncompressed, at the current file position.  */
+{
+  off_t  start = archive_pos(ar), pos;
+
+  if (write_all(ar->fd, meta, rec->meta_len) < 0)
+    return -1;
+  if (*out_p >= 0 && (lseek(*out_p, 0, SEEK_SET) < 0
+		      || copy_fd(*out_p, ar->fd) < 0))
+    return -1;
+  pos = archive_pos(ar);
+  rec->out_len = pos - start - rec->meta_len;
+  if (*err_p >= 0 && (lseek(*err_p, 0, SEEK_SET) < 0
+		      || copy_fd(*err_p, ar->fd) < 0))
+    return -1;
+  rec->err_len = archive_pos(ar) - pos;
+  rec->data_len = rec->meta_len + rec->out_len + rec->err_len;
+  return 0;
+}
+
+#ifdef HAVE_ZLIB
+static int
+deflate_fd(struct archive *ar, z_stream *z, int fd, const char *data,
+	   size_t len, uint64_t *len_p)
+/* Compress LEN bytes of DATA, or if DATA is NULL, the contents of
+ * FD, into the archive.  Store the number of input bytes in *LEN_P.
+ * Return 0 on success, -1 on a write error and -2 if the data does
+ * not shrink.  */
+{
+  unsigned char *in = ar->scratch, *out = ar->scratch + STREAM_CHUNK;
+  off_t  offset = 0;
+  ssize_t  n;
+
+  *len_p = 0;
+  for (;;) {
+    if (data) {
+      z->next_in = (unsigned char *)data;
+      z->avail_in = len;
+      n = len;
+    } else {
+      n = fd < 0 ? 0 : pread(fd, in, STREAM_CHUNK, offset);
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0)
+	return -1;
+      z->next_in = in;
+      z->avail_in = n;
+      offset += n;
+    }
+    if (n == 0)
+      return 0;
+    *len_p += n;
+    while (z->avail_in > 0) {
+      z->next_out = out;
+      z->avail_out = STREAM_CHUNK;
+      if (deflate(z, Z_NO_FLUSH) == Z_STREAM_ERROR)
+	return -2;
+      if (z->total_out >= z->total_in + STREAM_CHUNK)
+	return -2;
+      if (write_all(ar->fd, out, STREAM_CHUNK - z->avail_out) < 0)
+	return -1;
+    }
+    if (data)
+      return 0;
+  }
+}
+
+static int
+stream_zlib(struct archive *ar, struct record *rec, const char *meta,
+	    int out, int err)
+/* Write the data of REC compressed, at the current file position.
+ * Return 0 on success, -1 on a write error and -2 if the data does
+ * not shrink.  */
+{
+  unsigned char *buf;
+  uint64_t  meta_len;
+  z_stream  z;
+  int  res, zres;
+
+  memset(&z, 0, sizeof(z));
+  if (deflateInit(&z, Z_BEST_SPEED) != Z_OK)
+    return -2;
+  res = deflate_fd(ar, &z, -1, meta, rec->meta_len, &meta_len);
+  if (res == 0)
+    res = deflate_fd(ar, &z, out, NULL, 0, &rec->out_len);
+  if (res == 0)
+    res = deflate_fd(ar, &z, err, NULL, 0, &rec->err_len);
+  buf = ar->scratch + STREAM_CHUNK;
+  while (res == 0) {
+    z.next_out = buf;
+    z.avail_out = STREAM_CHUNK;
+    zres = deflate(&z, Z_FINISH);
+    if (write_all(ar->fd, buf, STREAM_CHUNK - z.avail_out) < 0)
+      res = -1;
+    else if (zres == Z_STREAM_END)
+      break;
+    else if (zres != Z_OK && zres != Z_BUF_ERROR)
+      res = -2;
+  }
+  if (res == 0 && z.total_out >= z.total_in)
+    res = -2;
+  rec->data_len = z.total_out;
+  deflateEnd(&z);
+  return res;
+}
+#endif
+
+static void
+stream_record(struct archive *ar, struct record *rec, const char *meta,
+	      int *out_p, int *err_p)
+/* Write a large record straight to the file, without holding its
+ * data in memory: the data is written first, and the header once the
+ * lengths are known.  An interrupted record thus has no valid header
+ * and is discarded when the archive is reopened.  */
+{
+  unsigned char  header[HEADER_SIZE];
+  off_t  start;
+  int  res = -2;
+
+  if (flush_archive(ar) < 0)
+    goto done;
+  start = ar->end;
+  if (lseek(ar->fd, start + HEADER_SIZE, SEEK_SET) < 0)
+    goto fail;
+#ifdef HAVE_ZLIB
+  if (ar->compress) {
+    if (! ar->scratch || ar->scratch_allocated < 2*STREAM_CHUNK) {
+      ar->scratch_allocated = 2*STREAM_CHUNK;
+      ar->scratch = xrenew(unsigned char, ar->scratch, 2*STREAM_CHUNK);
+    }
+    res = stream_zlib(ar, rec, meta, *out_p, *err_p);
+    if (res == 0)
+      rec->flags |= FLAG_ZLIB;
+    else if (res == -2 && lseek(ar->fd, start + HEADER_SIZE, SEEK_SET) < 0)
+      goto fail;
+  }
+#endif
+  if (res == -2)
+    res = stream_raw(ar, rec, meta, out_p, err_p);
+  if (res < 0)
+    goto fail;
+  /* drop the rest of an abandoned compression attempt */
+  if (ftruncate(ar->fd, start + HEADER_SIZE + rec->data_len) < 0)
+    goto fail;
+  encode_header(header, rec);
+  if (pwrite(ar->fd, header, HEADER_SIZE, start) != HEADER_SIZE)
+    goto fail;
+  add_entry(ar, rec->cmd_no, start);
+  ar->end = start + HEADER_SIZE + rec->data_len;
+  goto done;
+
+ fail:
+  error("error: cannot write archive \"%s\" (%m)", ar->path);
+  ar->failed = 1;
+ done:
+  if (*out_p >= 0)  close(*out_p);
+  if (*err_p >= 0)  close(*err_p);
+  *out_p = *err_p = -1;
+}
+
+void
+archive_finish(struct archive *ar, struct job *job, int status, int cached,
+	       double now)
+/* Append the status and the captured output of JOB to the archive.
+ * STATUS is the wait status of the job and NOW the current time.  */
+{
+  struct record  rec;
+  char *meta = NULL;
+  size_t  meta_len = 0, raw_len, max_len;
+  unsigned char *data;
+  FILE *f;
+
+  if (ar->failed) {
+    /* the error has been reported, don't pile up the output */
+    if (job->result_out >= 0)  close(job->result_out);
+    if (job->result_err >= 0)  close(job->result_err);
+    job->result_out = job->result_err = -1;
+    return;
+  }
+
+  f = open_memstream(&meta, &meta_len);
+  if (f) {
+    write_status(f, job, status, cached);
+    fclose(f);
+  }
+
+  memset(&rec, 0, sizeof(rec));
+  rec.cmd_no = job->cmd_no;
+  rec.status = status;
+  rec.meta_len = meta_len;
+  rec.out_len = buffer_size(job->result_out);
+  rec.err_len = buffer_size(job->result_err);
+  raw_len = rec.meta_len + rec.out_len + rec.err_len;
+
+  if (raw_len > ARCHIVE_STREAM) {
+    stream_record(ar, &rec, meta, &job->result_out, &job->result_err);
+    free(meta);
+    return;
+  }
+
+  max_len = raw_len;
+#ifdef HAVE_ZLIB
+  if (ar->compress)
+    max_len = compressBound(raw_len);
+#endif
+  if (ar->used + HEADER_SIZE + max_len > ar->allocated) {
+    ar->allocated = ar->used + HEADER_SIZE + max_len;
+    if (ar->allocated < ARCHIVE_BATCH + HEADER_SIZE)
+      ar->allocated = ARCHIVE_BATCH + HEADER_SIZE;
+    ar->buf = xrenew(unsigned char, ar->buf, ar->allocated);
+  }
+
+  /* Collect the data directly in the batch, or in the scratch buffer
+   * if it is to be compressed into the batch.  */
+  data = ar->buf + ar->used + HEADER_SIZE;
+  if (ar->compress) {
+    if (raw_len > ar->scratch_allocated) {
+      ar->scratch_allocated = raw_len;
+      ar->scratch = xrenew(unsigned char, ar->scratch, raw_len);
+    }
+    data = ar->scratch;
+  }
+  if (meta_len > 0)
+    memcpy(data, meta, meta_len);
+  free(meta);
+  rec.out_len = read_buffer(&job->result_out, data + rec.meta_len,
+			    rec.out_len);
+  rec.err_len = read_buffer(&job->result_err,
+			    data + rec.meta_len + rec.out_len, rec.err_len);
+  raw_len = rec.meta_len + rec.out_len + rec.err_len;
+  rec.data_len = raw_len;
+
+#ifdef HAVE_ZLIB
+  if (ar->compress) {
+    uLongf  len = max_len;
+    unsigned char *dst = ar->buf + ar->used + HEADER_SIZE;
+    if (compress2(dst, &len, data, raw_len, Z_BEST_SPEED) == Z_OK
+	&& len < raw_len) {
+      rec.flags |= FLAG_ZLIB;
+      rec.data_len = len;
+    } else {
+      memcpy(dst, data, raw_len);
+    }
+  }
+#endif
+
+  encode_header(ar->buf + ar->used, &rec);
+  add_entry(ar, rec.cmd_no, ar->end + ar->used);
+  if (ar->used == 0)
+    ar->first_pending = now;
+  ar->used += HEADER_SIZE + rec.data_len;
+  if (ar->used >= ARCHIVE_BATCH || now - ar->first_pending >= ARCHIVE_DELAY)
+    flush_archive(ar);
+}
+
+double
+archive_tick(struct archive *ar, double now)
+/* Write the pending records once the oldest has waited long enough.
+ * Return the number of seconds until this is due, or -1 if no records
+ * are pending.  */
+{
+  if (ar->used == 0 || ar->failed)
+    return -1;
+  if (now - ar->first_pending < ARCHIVE_DELAY)
+    return ar->first_pending + ARCHIVE_DELAY - now;
+  flush_archive(ar);
+  return -1;
+}
+
+
+/**********************************************************************
+ * reading the archive
+ */
+
+static int
+find_record(int fd, off_t size, long cmd_no, off_t *offset_p)
+/* Find the last record for command CMD_NO.  Return 0 on success and
+ * -1 if there is none.  */
+{
+  unsigned char  entry[ENTRY_SIZE];
+  uint64_t  lo, hi, mid, n;
+  off_t  index;
+
+  if (read_trailer(fd, size, &index, &n) < 0) {
+    /* an interrupted run, search the records instead */
+    struct archive  tmp;
+    long  i;
+    int  found = 0;
+
+    memset(&tmp, 0, sizeof(tmp));
+    scan_records(fd, size, &tmp);
+    for (i=0; i<tmp.n_index; ++i) {
+      if (tmp.index[i].cmd_no == (uint64_t)cmd_no) {
+	*offset_p = tmp.index[i].offset;
+	found = 1;
+      }
+    }
+    xfree(tmp.index);
+    return found ? 0 : -1;
+  }
+
+  /* find the first entry after CMD_NO */
+  lo = 0;
+  hi = n;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (read_at(fd, entry, ENTRY_SIZE, index + mid*ENTRY_SIZE) < 0)
+      return -1;
+    if (get_u64(entry) <= (uint64_t)cmd_no)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0
+      || read_at(fd, entry, ENTRY_SIZE, index + (lo-1)*ENTRY_SIZE) < 0
+      || get_u64(entry) != (uint64_t)cmd_no)
+    return -1;
+  *offset_p = get_u64(entry+8);
+  return 0;
+}
+
+static int
+emit_data(const unsigned char *buf, size_t len, uint64_t *pos_p,
+	  const struct record *rec, int out, int err)
+/* Write LEN bytes of the data of REC, which start at offset *POS_P of
+ * the data, to OUT or ERR; the status text is skipped.  Return 0 on
+ * success and -1 on error.  */
+{
+  uint64_t  pos = *pos_p, out_end = rec->meta_len + rec->out_len;
+  size_t  n;
+  int  fd;
+
+  while (len > 0) {
+    if (pos < rec->meta_len) {
+      n = rec->meta_len - pos < len ? rec->meta_len - pos : len;
+      fd = -1;
+    } else if (pos < out_end) {
+      n = out_end - pos < len ? out_end - pos : len;
+      fd = out;
+    } else {
+      n = len;
+      fd = err;
+    }
+    if (fd >= 0 && write_all(fd, buf, n) < 0)
+      return -1;
+    buf += n;
+    len -= n;
+    pos += n;
+  }
+  *pos_p = pos;
+  return 0;
+}
+
+static int
+copy_record(int fd, off_t offset, const struct record *rec, int out,
+	    int err)
+/* Copy the output in the record REC, whose data starts at OFFSET in
+ * FD, to OUT and ERR, one chunk at a time.  Return 0 on success, -1 on
+ * a read or write error and -2 if the record is corrupted.  */
+{
+  uint64_t  raw_len = rec->meta_len + rec->out_len + rec->err_len;
+  uint64_t  done = 0, pos = 0;
+  unsigned char *in, *buf;
+  size_t  n;
+  int  rc = 0;
+#ifdef HAVE_ZLIB
+  z_stream  z;
+  int  zres = Z_OK;
+#endif
+
+  if (! (rec->flags & FLAG_ZLIB) && rec->data_len != raw_len)
+    return -2;
+#ifndef HAVE_ZLIB
+  if (rec->flags & FLAG_ZLIB) {
+    errno = ENOSYS;
+    return -1;
+  }
+#else
+  memset(&z, 0, sizeof(z));
+  if ((rec->flags & FLAG_ZLIB) && inflateInit(&z) != Z_OK)
+    return -2;
+#endif
+
+  in = xnew(unsigned char, 2*STREAM_CHUNK);
+  buf = in + STREAM_CHUNK;
+  while (rc == 0 && done < rec->data_len) {
+    n = rec->data_len - done < STREAM_CHUNK ? rec->data_len - done
+      : STREAM_CHUNK;
+    if (read_at(fd, in, n, offset + done) < 0) {
+      rc = -1;
+      break;
+    }
+    done += n;
+    if (! (rec->flags & FLAG_ZLIB)) {
+      rc = emit_data(in, n, &pos, rec, out, err);
+      continue;
+    }
+#ifdef HAVE_ZLIB
+    z.next_in = in;
+    z.avail_in = n;
+    do {
+      z.next_out = buf;
+      z.avail_out = STREAM_CHUNK;
+      zres = inflate(&z, Z_NO_FLUSH);
+      if (zres == Z_BUF_ERROR)	/* needs more input */
+	break;
+      if (zres != Z_OK && zres != Z_STREAM_END) {
+	rc = -2;
+	break;
+      }
+      n = STREAM_CHUNK - z.avail_out;
+      if (pos + n > raw_len)
+	rc = -2;
+      else
+	rc = emit_data(buf, n, &pos, rec, out, err);
+    } while (rc == 0 && zres != Z_STREAM_END
+	     && (z.avail_in > 0 || z.avail_out == 0));
+#endif
+  }
+#ifdef HAVE_ZLIB
+  if (rec->flags & FLAG_ZLIB) {
+    if (rc == 0 && zres != Z_STREAM_END)
+      rc = -2;
+    inflateEnd(&z);
+  }
+#endif
+  if (rc == 0 && pos != raw_len)
+    rc = -2;
+  xfree(in);
+  return rc;
+}
+
+int
+archive_extract(const char *path, long cmd_no, int out, int err,
+		int *status_p)
+/* Copy the output of command CMD_NO from the archive PATH to the file
+ * descriptors OUT and ERR, and store its wait status in *STATUS_P.
+ * On error, a message is emitted and -1 is returned.  */
+{
+  unsigned char  header[HEADER_SIZE];
+  char  magic[sizeof(FILE_MAGIC)-1];
+  struct record  rec;
+  struct stat  st;
+  off_t  offset;
+  int  fd, rc = -1;
+
+  fd = open(path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    error("error: cannot open archive \"%s\" (%m)", path);
+    goto out;
+  }
+  if (read_at(fd, magic, sizeof(magic), 0) < 0
+      || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0) {
+    error("error: \"%s\" is not an archive", path);
+    goto out;
+  }
+  if (find_record(fd, st.st_size, cmd_no, &offset) < 0) {
+    error("error: command %ld is not in \"%s\"", cmd_no, path);
+    goto out;
+  }
+  if (read_at(fd, header, HEADER_SIZE, offset) < 0
+      || decode_header(header, &rec) < 0
+      || rec.data_len > (uint64_t)(st.st_size - offset - HEADER_SIZE)) {
+    error("error: \"%s\" is corrupted", path);
+    goto out;
+  }
+
+  switch (copy_record(fd, offset + HEADER_SIZE, &rec, out, err)) {
+  case 0:
+    *status_p = rec.status;
+    rc = 0;
+    break;
+  case -2:
+    error("error: \"%s\" is corrupted", path);
+    break;
+  default:
+    error("error: cannot copy command %ld from \"%s\" (%m)", cmd_no, path);
+    break;
+  }
+
+ out:
+  if (fd >= 0)
+    close(fd);
+  return rc;
+}
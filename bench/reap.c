@@ -0,0 +1,95 @@
+/* reap.c - measure how fast the pool starts and reaps jobs
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Usage: reap SLOTS JOBS [SECONDS [zombie]]
+ *
+ * Runs JOBS times "sleep SECONDS" through libparallel, using SLOTS
+ * slots, and prints the number of jobs per second.  The pool does not
+ * own all children of the process, like in a program which embeds the
+ * library.  With "zombie", the program first creates a child of its
+ * own which is never reaped, so that the pool has to tell its own
+ * finished jobs apart from a foreign one for the whole run.  */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libparallel.h"
+
+
+static double
+now(void)
+{
+  struct timespec  ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+int
+main(int argc, char **argv)
+{
+  struct pool_config  cfg;
+  struct pool_stats  st;
+  struct pool *pool;
+  char *sleep_argv[3];
+  long  slots, n_jobs, i;
+  double  start, elapsed;
+  int  zombie;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s SLOTS JOBS [SECONDS [zombie]]\n", argv[0]);
+    return 1;
+  }
+  slots = atol(argv[1]);
+  n_jobs = atol(argv[2]);
+  sleep_argv[0] = "sleep";
+  sleep_argv[1] = argc > 3 ? argv[3] : "0.1";
+  sleep_argv[2] = NULL;
+  zombie = argc > 4 && strcmp(argv[4], "zombie") == 0;
+
+  if (zombie && fork() == 0)
+    _exit(0);
+
+  pool_config_init(&cfg);
+  cfg.slots = slots;
+  cfg.lookahead = 1;
+  cfg.jobserver = "none";
+  cfg.nice = 0;
+  pool = new_pool(&cfg);
+  if (! pool)
+    return 1;
+  for (i=0; i<n_jobs; ++i)
+    pool_submit_argv(pool, sleep_argv);
+
+  start = now();
+  if (pool_wait(pool) < 0) {
+    perror("pool_wait");
+    return 1;
+  }
+  elapsed = now() - start;
+  pool_stats(pool, &st);
+  delete_pool(pool);
+
+  printf("%6ld slots%s: %ld jobs in %.2f seconds, %.0f jobs/s\n",
+	 slots, zombie ? ", foreign zombie" : "", st.done, elapsed,
+	 elapsed > 0 ? st.done / elapsed : 0);
+  return st.failed > 0;
+}
@@ -0,0 +1,35 @@
+#! /bin/sh
+# scale.sh - show how the job throughput grows with the number of slots
+# Copyright 2009  Jochen Voss
+#
+# Every job sleeps for $BENCH_SLEEP seconds (default 0.1), so with N
+# slots at most N/$BENCH_SLEEP jobs per second are possible.  Each slot
+# count is measured once through the command line tool, with and
+# without spawner threads, and through the library, with and without
+# a foreign zombie child.
+
+top=${top_builddir:-.}
+slots=${BENCH_SLOTS:-"1 10 100 1000"}
+sleep_time=${BENCH_SLEEP:-0.1}
+rounds=${BENCH_ROUNDS:-10}
+
+tmp=${TMPDIR:-/tmp}/parallel-bench.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 1
+
+for n in $slots; do
+  jobs=$((n * rounds))
+  i=0
+  while [ $i -lt $jobs ]; do echo "sleep $sleep_time"; i=$((i+1)); done \
+    > "$tmp/cmds"
+  for spawners in 0 4; do
+    opt=
+    test $spawners -gt 0 && opt="--spawners=$spawners"
+    rate=$("$top/parallel" -v -n $n $opt --jobserver=none -c "$tmp/cmds" \
+	     2>&1 >/dev/null | sed -n 's/.*seconds (\([0-9]*\) jobs\/s)$/\1/p')
+    printf '%6d slots, %d spawners: %d jobs, %s jobs/s (ideal %d)\n' \
+      $n $spawners $jobs "$rate" $(awk "BEGIN { print int($n / $sleep_time) }")
+  done
+  "$top/bench/reap" $n $jobs $sleep_time
+  "$top/bench/reap" $n $jobs $sleep_time zombie
+done
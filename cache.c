@@ -0,0 +1,545 @@
+/* cache.c - remember the results of commands which were run before
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Layout of the cache directory:
+ *
+ *   DIR/xx/KEY/status   exit status of the command, in decimal
+ *   DIR/xx/KEY/stdout   captured standard output
+ *   DIR/xx/KEY/stderr   captured standard error output
+ *   DIR/inputs/NAMEKEY  memoised hash of an input file
+ *   DIR/tmp/            entries which are still being written
+ *   DIR/lock            taken while old entries are removed
+ *
+ * KEY is the hash of the working directory, the command text and the
+ * contents of all declared input files, "xx" are its first two
+ * digits.  Entries are created in DIR/tmp and then atomically renamed
+ * into place, so that several instances of parallel can share one
+ * cache.  The modification time of the status file records when an
+ * entry was last used; when the cache grows beyond its size limit,
+ * the least recently used entries are removed.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/sendfile.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "parallel.h"
+
+
+struct cache {
+  char *dir;
+  char *cwd;
+  unsigned long long  max_size;
+  unsigned long long  added;	/* bytes stored since the last clean-up */
+};
+
+static const char *entry_files[] = { "status", "stdout", "stderr" };
+
+
+struct cache *
+open_cache(const char *dir, unsigned long long max_size)
+{
+  struct cache *c;
+  char *path;
+  int  rc;
+
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+    return NULL;
+  asprintf(&path, "%s/tmp", dir);
+  rc = mkdir(path, 0777);
+  free(path);
+  if (rc < 0 && errno != EEXIST)
+    return NULL;
+  asprintf(&path, "%s/inputs", dir);
+  rc = mkdir(path, 0777);
+  free(path);
+  if (rc < 0 && errno != EEXIST)
+    return NULL;
+
+  c = xnew(struct cache, 1);
+  c->dir = xstrdup(dir);
+  c->cwd = getcwd(NULL, 0);
+  if (! c->cwd)
+    c->cwd = xstrdup("");
+  c->max_size = max_size;
+  c->added = 0;
+  return c;
+}
+
+static void cache_clean(struct cache *c);
+
+void
+close_cache(struct cache *c)
+{
+  if (c->added > 0)
+    cache_clean(c);
+  xfree(c->dir);
+  free(c->cwd);
+  xfree(c);
+}
+
+int
+copy_fd(int in, int out)
+/* Copy all data from file descriptor IN to OUT.  Return 0 on success
+ * and -1 on error.  */
+{
+  char  buffer[65536];
+  ssize_t  n;
+
+  for (;;) {
+    n = sendfile(out, in, NULL, 1<<30);
+    if (n > 0)
+      continue;
+    if (n == 0)
+      return 0;
+    if (errno == EINTR)
+      continue;
+    if (errno == EINVAL || errno == ENOSYS)
+      break;
+    return -1;
+  }
+
+  for (;;) {
+    char *ptr;
+
+    n = read(in, buffer, sizeof(buffer));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n;
+    ptr = buffer;
+    while (n > 0) {
+      ssize_t  m = write(out, ptr, n);
+      if (m < 0 && errno == EINTR)
+	continue;
+      if (m < 0)
+	return -1;
+      ptr += m;
+      n -= m;
+    }
+  }
+}
+
+static int
+cache_hash_file(struct cache *c, const char *fname, char *hex)
+/* Store the hash of the contents of FNAME in HEX.  Hashes are
+ * memoised in the cache directory, together with the device, inode,
+ * size and modification time of the file, so that unchanged files are
+ * not read again.  Return 0 on success and -1 if the file cannot be
+ * read.  */
+{
+  struct hash  h;
+  struct stat  st;
+  char  namekey[33], memo[33];
+  char *memo_path, *tmp_path;
+  char  buffer[65536];
+  FILE *f;
+  int  fd, found = 0;
+  ssize_t  n;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  hash_init(&h);
+  hash_update(&h, fname, strlen(fname)+1);
+  hash_update(&h, c->cwd, strlen(c->cwd));
+  hash_final(&h, namekey);
+  asprintf(&memo_path, "%s/inputs/%s", c->dir, namekey);
+
+  f = fopen(memo_path, "r");
+  if (f) {
+    unsigned long long  dev, ino, size, sec, nsec;
+    if (fscanf(f, "%llu %llu %llu %llu %llu %32s",
+	       &dev, &ino, &size, &sec, &nsec, memo) == 6
+	&& dev == (unsigned long long)st.st_dev
+	&& ino == (unsigned long long)st.st_ino
+	&& size == (unsigned long long)st.st_size
+	&& sec == (unsigned long long)st.st_mtim.tv_sec
+	&& nsec == (unsigned long long)st.st_mtim.tv_nsec) {
+      strcpy(hex, memo);
+      found = 1;
+    }
+    fclose(f);
+  }
+  if (found) {
+    close(fd);
+    free(memo_path);
+    return 0;
+  }
+
+  hash_init(&h);
+  while ((n = read(fd, buffer, sizeof(buffer))) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      close(fd);
+      free(memo_path);
+      return -1;
+    }
+    hash_update(&h, buffer, n);
+  }
+  close(fd);
+  hash_final(&h, hex);
+
+  asprintf(&tmp_path, "%s.%d", memo_path, (int)getpid());
+  f = fopen(tmp_path, "w");
+  if (f) {
+    fprintf(f, "%llu %llu %llu %llu %llu %s\n",
+	    (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+	    (unsigned long long)st.st_size,
+	    (unsigned long long)st.st_mtim.tv_sec,
+	    (unsigned long long)st.st_mtim.tv_nsec, hex);
+    if (fclose(f) == 0)
+      rename(tmp_path, memo_path);
+    else
+      unlink(tmp_path);
+  }
+  free(tmp_path);
+  free(memo_path);
+  return 0;
+}
+
+static int
+cache_compute_key(struct cache *c, struct job *job)
+{
+  struct hash  h;
+  char  hex[33];
+  int  i;
+
+  hash_init(&h);
+  hash_update(&h, "parallel-cache-1", 17);
+  hash_update(&h, c->cwd, strlen(c->cwd)+1);
+  hash_update(&h, job->cmd, strlen(job->cmd)+1);
+  for (i=0; i<job->n_inputs; ++i) {
+    if (cache_hash_file(c, job->inputs[i], hex) < 0) {
+      warning("warning: command %ld: cannot read input \"%s\" (%m),"
+	      " not cached", job->cmd_no, job->inputs[i]);
+      return -1;
+    }
+    hash_update(&h, job->inputs[i], strlen(job->inputs[i])+1);
+    hash_update(&h, hex, 32);
+  }
+  job->cache_key = xnew(char, 33);
+  hash_final(&h, job->cache_key);
+  return 0;
+}
+
+static void
+remove_entry(const char *path)
+/* Remove a cache entry.  The status file goes first, so that
+ * concurrent readers see a miss rather than an incomplete entry.  */
+{
+  char *fname;
+  unsigned  i;
+
+  for (i=0; i<sizeof(entry_files)/sizeof(entry_files[0]); ++i) {
+    asprintf(&fname, "%s/%s", path, entry_files[i]);
+    unlink(fname);
+    free(fname);
+  }
+  rmdir(path);
+}
+
+int
+cache_lookup(struct cache *c, struct job *job, int *status_p)
+/* Look up JOB in the cache.  On a hit, the recorded output is copied
+ * to the job's result files, or to stdout and stderr, the recorded wait
+ * status is stored in '*status_p' and 1 is returned.  Otherwise 0 is
+ * returned.  */
+{
+  char *path;
+  int  fd[3], i, rc, exit_status;
+  char  buffer[32];
+  ssize_t  n;
+
+  if (! job->cache_key && cache_compute_key(c, job) < 0)
+    return 0;
+
+  for (i=0; i<3; ++i) {
+    asprintf(&path, "%s/%.2s/%s/%s", c->dir, job->cache_key,
+	     job->cache_key, entry_files[i]);
+    fd[i] = open(path, O_RDONLY);
+    if (i == 0 && fd[0] >= 0)
+      utimensat(AT_FDCWD, path, NULL, 0);
+    free(path);
+    if (fd[i] < 0) {
+      while (i-- > 0)
+	close(fd[i]);
+      return 0;
+    }
+  }
+
+  n = read(fd[0], buffer, sizeof(buffer)-1);
+  rc = 0;
+  if (n > 0) {
+    buffer[n] = '\0';
+    exit_status = atoi(buffer);
+    if (exit_status >= 0 && exit_status < 256) {
+      *status_p = exit_status << 8;
+      if (copy_fd(fd[1], job_output_fd(job, 1)) < 0
+	  || copy_fd(fd[2], job_output_fd(job, 2)) < 0)
+	error("error: cannot replay output of command %ld (%m)",
+	      job->cmd_no);
+      rc = 1;
+    }
+  }
+  for (i=0; i<3; ++i)
+    close(fd[i]);
+  return rc;
+}
+
+int
+cache_prepare(struct cache *c, struct job *job)
+/* Arrange for the output of JOB to be captured, so that it can be
+ * stored in the cache after the job has finished.  This must be called
+ * after 'cache_lookup'.  Return 0 on success and -1 if the output
+ * cannot be captured.  */
+{
+  char *fname;
+
+  if (! job->cache_key)
+    return -1;
+
+  asprintf(&job->cache_tmp, "%s/tmp/%s.%d.%ld", c->dir,
+	   job->cache_key, (int)getpid(), job->cmd_no);
+  if (mkdir(job->cache_tmp, 0777) < 0)
+    goto fail;
+
+  asprintf(&fname, "%s/stdout", job->cache_tmp);
+  job->out_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+  free(fname);
+  asprintf(&fname, "%s/stderr", job->cache_tmp);
+  job->err_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+  free(fname);
+  if (job->out_fd >= 0 && job->err_fd >= 0)
+    return 0;
+
+  if (job->out_fd >= 0)  close(job->out_fd);
+  if (job->err_fd >= 0)  close(job->err_fd);
+  job->out_fd = job->err_fd = -1;
+  remove_entry(job->cache_tmp);
+ fail:
+  error("error: cannot create cache entry for command %ld (%m)",
+	job->cmd_no);
+  free(job->cache_tmp);
+  job->cache_tmp = NULL;
+  return -1;
+}
+
+void
+cache_store(struct cache *c, struct job *job, int status)
+/* Copy the captured output of JOB to its result files, or to stdout
+ * and stderr, and, if the job exited normally, move the new entry into
+ * place.  */
+{
+  char *fname, *path;
+  struct stat  st;
+  unsigned long long  size = 0;
+  FILE *f;
+  int  i, fd;
+
+  if (! job->cache_tmp)
+    return;
+
+  for (i=1; i<3; ++i) {
+    asprintf(&fname, "%s/%s", job->cache_tmp, entry_files[i]);
+    fd = open(fname, O_RDONLY);
+    free(fname);
+    if (fd < 0 || copy_fd(fd, job_output_fd(job, i)) < 0)
+      error("error: cannot replay output of command %ld (%m)",
+	    job->cmd_no);
+    if (fd >= 0) {
+      if (fstat(fd, &st) == 0)
+	size += st.st_size;
+      close(fd);
+    }
+  }
+
+  if (! WIFEXITED(status)) {
+    remove_entry(job->cache_tmp);
+    return;
+  }
+
+  asprintf(&fname, "%s/status", job->cache_tmp);
+  f = fopen(fname, "w");
+  free(fname);
+  if (! f) {
+    remove_entry(job->cache_tmp);
+    return;
+  }
+  fprintf(f, "%d\n", WEXITSTATUS(status));
+  if (fclose(f) != 0) {
+    remove_entry(job->cache_tmp);
+    return;
+  }
+
+  asprintf(&path, "%s/%.2s", c->dir, job->cache_key);
+  mkdir(path, 0777);
+  free(path);
+  asprintf(&path, "%s/%.2s/%s", c->dir, job->cache_key, job->cache_key);
+  if (rename(job->cache_tmp, path) < 0) {
+    /* another instance of parallel was faster */
+    remove_entry(job->cache_tmp);
+  } else {
+    c->added += size;
+  }
+  free(path);
+
+  if (c->added > c->max_size / 8)
+    cache_clean(c);
+}
+
+void
+cache_discard(struct job *job)
+/* Remove the partial entry of a job which could not be started.  */
+{
+  if (job->out_fd >= 0)  close(job->out_fd);
+  if (job->err_fd >= 0)  close(job->err_fd);
+  job->out_fd = job->err_fd = -1;
+  if (job->cache_tmp) {
+    remove_entry(job->cache_tmp);
+    free(job->cache_tmp);
+    job->cache_tmp = NULL;
+  }
+}
+
+struct entry {
+  char *path;
+  time_t  last_used;
+  unsigned long long  size;
+};
+
+static int
+compare_entries(const void *a, const void *b)
+{
+  const struct entry *ea = a, *eb = b;
+  return (ea->last_used > eb->last_used) - (ea->last_used < eb->last_used);
+}
+
+static void
+cache_clean(struct cache *c)
+/* Remove the least recently used entries until the cache is less than
+ * 90% full.  Left-over temporary entries older than a day are removed,
+ * too.  If another process is already cleaning the cache, nothing is
+ * done.  */
+{
+  struct entry *entries = NULL;
+  long  n_entries = 0, n_allocated = 0, i;
+  unsigned long long  total = 0;
+  char *path;
+  int  lock_fd;
+  DIR *top, *sub;
+  struct dirent *d1, *d2;
+  struct stat  st;
+  time_t  now = time(NULL);
+
+  c->added = 0;
+
+  asprintf(&path, "%s/lock", c->dir);
+  lock_fd = open(path, O_RDWR|O_CREAT, 0666);
+  free(path);
+  if (lock_fd < 0)
+    return;
+  if (flock(lock_fd, LOCK_EX|LOCK_NB) < 0) {
+    close(lock_fd);
+    return;
+  }
+
+  top = opendir(c->dir);
+  while (top && (d1 = readdir(top))) {
+    char *subdir;
+    int  is_tmp = strcmp(d1->d_name, "tmp") == 0;
+
+    if (! is_tmp && (strlen(d1->d_name) != 2 || d1->d_name[0] == '.'))
+      continue;
+    asprintf(&subdir, "%s/%s", c->dir, d1->d_name);
+    sub = opendir(subdir);
+    while (sub && (d2 = readdir(sub))) {
+      unsigned long long  size = 0;
+      time_t  last_used = 0;
+      char *fname;
+      unsigned  j;
+
+      if (d2->d_name[0] == '.')
+	continue;
+      asprintf(&path, "%s/%s", subdir, d2->d_name);
+      for (j=0; j<sizeof(entry_files)/sizeof(entry_files[0]); ++j) {
+	asprintf(&fname, "%s/%s", path, entry_files[j]);
+	if (stat(fname, &st) == 0) {
+	  size += st.st_size;
+	  if (j == 0)
+	    last_used = st.st_mtime;
+	}
+	free(fname);
+      }
+
+      if (is_tmp) {
+	if (stat(path, &st) == 0 && now - st.st_mtime > 24*60*60)
+	  remove_entry(path);
+	free(path);
+	continue;
+      }
+
+      if (n_entries == n_allocated) {
+	n_allocated = n_allocated ? 2*n_allocated : 256;
+	entries = xrenew(struct entry, entries, n_allocated);
+      }
+      entries[n_entries].path = path;
+      entries[n_entries].last_used = last_used;
+      entries[n_entries].size = size;
+      ++n_entries;
+      total += size;
+    }
+    if (sub)
+      closedir(sub);
+    free(subdir);
+  }
+  if (top)
+    closedir(top);
+
+  if (total > c->max_size) {
+    unsigned long long  target = c->max_size / 10 * 9;
+    qsort(entries, n_entries, sizeof(struct entry), compare_entries);
+    for (i=0; i<n_entries && total > target; ++i) {
+      remove_entry(entries[i].path);
+      total -= entries[i].size;
+    }
+  }
+  for (i=0; i<n_entries; ++i)
+    free(entries[i].path);
+  xfree(entries);
+
+  close(lock_fd);
+}
@@ -21,7 +21,10 @@
 #endif
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <ctype.h>
 #include <errno.h>
 #include <assert.h>
@@ -30,33 +33,89 @@
 
 
 struct cf {
-  FILE *fd;
+  int  fd;
+  struct dstream *ds;		/* decompressor, or NULL */
   char *buffer;
   unsigned long allocated, used, pos;
-  int has_error;
+  int has_error, at_eof;
+  long  n_read;			/* number of commands read so far */
+  long  first, last;		/* range of commands to use, or -1 */
+  long  shard_k, shard_n;	/* select commands by hash, or 0 */
 };
 
+static void
+cf_skip_whitespace(struct cf *cf)
+{
+  while (cf->pos < cf->used && isspace(cf->buffer[cf->pos]))
+    ++cf->pos;
+}
+
+/* The number of bytes used to recognise compressed files.  */
+#define LEAD_LEN 6
+
 struct cf *
 new_cf(const char *fname)
+/* Open the command file FNAME, or stdin if FNAME is NULL.  Files
+ * compressed with gzip, xz or zstd are recognised by their first bytes
+ * and are decompressed on the fly.  */
 {
-  FILE *fd;
+  int  fd;
   struct cf *res;
+  char  lead[LEAD_LEN];
+  size_t  len;
+  const char *format;
 
   if (fname)
-    fd = fopen(fname, "r");
+    fd = open(fname, O_RDONLY);
   else
-    fd = stdin;
-  if (! fd) {
+    fd = 0;
+  if (fd < 0) {
     return NULL;
   }
 
   res = xnew(struct cf, 1);
   res->fd = fd;
-  res->allocated = 512;
+  res->ds = NULL;
+  res->allocated = 65536;
   res->buffer = xnew(char, res->allocated);
   res->used = 0;
   res->pos = 0;
   res->has_error = 0;
+  res->at_eof = 0;
+  res->n_read = 0;
+  res->first = res->last = -1;
+  res->shard_k = res->shard_n = 0;
+
+  len = 0;
+  while (len < LEAD_LEN) {
+    ssize_t  rc = read(fd, lead+len, LEAD_LEN-len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0) {
+      error("error: read from command file failed (%m)");
+      res->has_error = 1;
+    }
+    if (rc <= 0)
+      break;
+    len += rc;
+  }
+
+  format = compression_format(lead, len);
+  if (format) {
+    res->ds = new_dstream(fd, lead, len);
+    if (! res->ds) {
+      error("error: cannot read %s-compressed command file"
+	    " (not supported by this build)", format);
+      delete_cf(res);
+      return NULL;
+    }
+  } else {
+    memcpy(res->buffer, lead, len);
+    res->used = len;
+    if (len < LEAD_LEN)
+      res->at_eof = ! res->has_error;
+  }
+  cf_skip_whitespace(res);
   return res;
 }
 
@@ -65,8 +124,10 @@ delete_cf(struct cf *cf)
 {
   int rc;
 
-  if (cf->fd != stdin) {
-    rc = fclose(cf->fd);
+  if (cf->ds)
+    delete_dstream(cf->ds);
+  if (cf->fd != 0) {
+    rc = close(cf->fd);
     if (rc) {
       warning("warning: error while closing command file (ignored)");
     }
@@ -75,13 +136,6 @@ delete_cf(struct cf *cf)
   xfree(cf);
 }
 
-static void
-cf_skip_whitespace(struct cf *cf)
-{
-  while (cf->pos < cf->used && isspace(cf->buffer[cf->pos]))
-    ++cf->pos;
-}
-
 static char *
 cf_extend(struct cf *cf)
 /* Load more data in the buffer, until the next line is complete.  The
@@ -97,13 +151,13 @@ cf_extend(struct cf *cf)
 
   for (;;) {
     char *eol;
-    size_t rc;
+    ssize_t rc;
 
     eol = memchr(cf->buffer+cf->pos, '\n', cf->used - cf->pos);
     if (eol)
       return eol;
 
-    if (cf->has_error)
+    if (cf->has_error || cf->at_eof)
       return NULL;
 
     if (cf->used == cf->allocated) {
@@ -111,22 +165,27 @@ cf_extend(struct cf *cf)
       cf->buffer = xrenew(char, cf->buffer, cf->allocated);
     }
 
-    clearerr(cf->fd);
-    rc = fread(cf->buffer + cf->used, 1, cf->allocated - cf->used, cf->fd);
+    if (cf->ds)
+      rc = dstream_read(cf->ds, cf->buffer + cf->used,
+			cf->allocated - cf->used);
+    else
+      rc = read(cf->fd, cf->buffer + cf->used, cf->allocated - cf->used);
 
     if (rc > 0) {
       cf->used += rc;
       cf_skip_whitespace(cf);
       continue;
     }
-    if (errno == EINTR) {
-      clearerr(cf->fd);
+    if (rc < 0 && ! cf->ds && errno == EINTR)
       continue;
-    }
 
-    if (ferror(cf->fd)) {
-      error("error: read from command file failed (%m)");
+    if (rc < 0) {
+      /* the decompressor reports its own errors */
+      if (! cf->ds)
+	error("error: read from command file failed (%m)");
       cf->has_error = 1;
+    } else {
+      cf->at_eof = 1;
     }
     return NULL;
   }
@@ -158,10 +217,18 @@ cf_next(struct cf *cf)
   return base;
 }
 
+int
+cf_has_error(const struct cf *cf)
+/* Return 1 if reading the command file failed, so that the commands
+ * after the damage are missing.  */
+{
+  return cf->has_error;
+}
+
 int
 cf_is_incomplete(const struct cf *cf)
 {
-  if (! feof(cf->fd))
+  if (! cf->at_eof)
     return 0;			/* eof not reached */
   if (memchr(cf->buffer+cf->pos, '\n', cf->used-cf->pos))
     return 0;			/* at least one line available */
@@ -169,3 +236,175 @@ cf_is_incomplete(const struct cf *cf)
     return 0;			/* all data processed */
   return 1;
 }
+
+static int
+cf_set_attribute(struct job *job, const char *key, size_t keylen,
+		 const char *val)
+/* Store one "key=value" annotation in JOB.  Return 0 on success and
+ * -1 if the annotation is not understood.  */
+{
+  char *tail;
+
+  if (keylen == 4 && strncmp(key, "cpus", 4) == 0) {
+    long  cpus;
+    errno = 0;
+    cpus = strtol(val, &tail, 0);
+    if (tail == val || *tail != '\0' || errno || cpus < 1)
+      return -1;
+    job->cpus = cpus;
+  } else if (keylen == 3 && strncmp(key, "mem", 3) == 0) {
+    if (parse_size(val, &job->mem) < 0)
+      return -1;
+  } else if (keylen == 2 && strncmp(key, "in", 2) == 0) {
+    if (! *val)
+      return -1;
+    job->inputs = xrenew(char *, job->inputs, job->n_inputs+1);
+    job->inputs[job->n_inputs++] = xstrdup(val);
+  } else if (keylen == 4 && strncmp(key, "time", 4) == 0) {
+    if (parse_duration(val, &job->duration) < 0)
+      return -1;
+  } else if (keylen == 5 && strncmp(key, "queue", 5) == 0) {
+    if (! *val)
+      return -1;
+    xfree(job->queue_name);
+    job->queue_name = xstrdup(val);
+  } else if (keylen == 4 && strncmp(key, "nice", 4) == 0) {
+    if (parse_nice(val, &job->prio.nice) < 0)
+      return -1;
+  } else if (keylen == 5 && strncmp(key, "sched", 5) == 0) {
+    if (parse_sched_policy(val, &job->prio.policy) < 0)
+      return -1;
+  } else if (keylen == 6 && strncmp(key, "ionice", 6) == 0) {
+    if (parse_ioprio(val, &job->prio.ioprio) < 0)
+      return -1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int
+cf_in_shard(const struct cf *cf, const char *line)
+{
+  struct hash  h;
+  char  hex[33];
+
+  if (cf->shard_n == 0)
+    return 1;
+  hash_init(&h);
+  hash_update(&h, line, strlen(line));
+  hash_final(&h, hex);
+  hex[16] = '\0';
+  return strtoull(hex, NULL, 16) % cf->shard_n == cf->shard_k - 1;
+}
+
+int
+cf_set_shard(struct cf *cf, const char *fname, long k, long n,
+	     int by_hash, int use_index)
+/* Restrict the command file to shard K of N.  If BY_HASH is set,
+ * commands are assigned to shards by a hash of the command line.
+ * Otherwise, shard K consists of the K-th of N consecutive blocks of
+ * commands; the start of the block is found using the index of the
+ * file FNAME, which is kept in FNAME.idx if USE_INDEX is set.  Return
+ * 0 on success and -1 on error.  */
+{
+  struct cf_index *idx;
+  long  total, found;
+  off_t  offset;
+
+  assert(1 <= k && k <= n);
+  if (by_hash) {
+    cf->shard_k = k;
+    cf->shard_n = n;
+    return 0;
+  }
+
+  if (! fname) {
+    error("error: sharding by line needs a command file (-c)");
+    return -1;
+  }
+  if (cf->ds) {
+    error("error: cannot shard a compressed command file by line");
+    return -1;
+  }
+  idx = open_index(fname, use_index);
+  if (! idx) {
+    error("error: cannot index command file \"%s\" (%m)", fname);
+    return -1;
+  }
+  total = index_commands(idx);
+  cf->first = (long long)total * (k-1) / n + 1;
+  cf->last = (long long)total * k / n;
+  offset = index_seek(idx, cf->first - 1, &found);
+  close_index(idx);
+
+  if (lseek(cf->fd, offset, SEEK_SET) == (off_t)-1) {
+    error("error: cannot seek in command file (%m)");
+    return -1;
+  }
+  cf->used = cf->pos = 0;
+  cf->at_eof = 0;
+  cf->n_read = found;
+  return 0;
+}
+
+struct job *
+cf_next_job(struct cf *cf)
+/* Read the next command of the shard from the command file and
+ * convert it into a job.  Commands are numbered by their position in
+ * the file, so that all shards use the same numbers.
+ * A line may start with a list of annotations of the form
+ * "#[key=value ...]", describing the resources the command needs and
+ * the input files it reads.
+ * Since '#' starts a comment in /bin/sh, such lines were no-ops
+ * before annotations were introduced.  Return NULL at the end of the
+ * file.  */
+{
+  const char *line, *ptr, *cmd;
+  struct job *job;
+  long  cmd_no;
+  char *val;
+
+  do {
+    if (cf->last >= 0 && cf->n_read >= cf->last)
+      return NULL;
+    line = cf_next(cf);
+    if (! line)
+      return NULL;
+    cmd_no = ++cf->n_read;
+  } while (cmd_no < cf->first || ! cf_in_shard(cf, line));
+  if (strncmp(line, "#[", 2) != 0 || ! strchr(line, ']'))
+    return new_job(cmd_no, line);
+
+  ptr = strchr(line, ']');
+  cmd = ptr+1;
+  while (isspace(*cmd))
+    ++cmd;
+  job = new_job(cmd_no, cmd);
+  val = xnew(char, ptr-line);
+  line += 2;
+  for (;;) {
+    const char *key, *end;
+
+    while (line < ptr && isspace(*line))
+      ++line;
+    if (line == ptr)
+      break;
+    key = line;
+    while (line < ptr && ! isspace(*line) && *line != ',')
+      ++line;
+    end = memchr(key, '=', line-key);
+    if (end) {
+      memcpy(val, end+1, line-end-1);
+      val[line-end-1] = '\0';
+    }
+    if (! end || cf_set_attribute(job, key, end-key, val) < 0)
+      error("error: command %ld: invalid annotation \"%.*s\" (ignored)",
+	    cmd_no, (int)(line-key), key);
+    if (line < ptr && *line == ',')
+      ++line;
+  }
+  xfree(val);
+
+  return job;
+}
@@ -0,0 +1,187 @@
+/* counters.c - measure jobs with performance counters
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The counters are attached to the child process after fork() and
+ * before exec(), and are inherited by all its descendants.  Counting
+ * starts when the child calls exec().  Once the job has finished, the
+ * counters hold the totals for all processes of the job.
+ *
+ * Hardware counters are often not available, e.g. in containers or
+ * virtual machines.  Each counter is checked once at startup, and
+ * only the available ones are used.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "parallel.h"
+
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+struct counter_type {
+  const char *name;
+  uint32_t  type;
+  uint64_t  config;
+};
+
+static const struct counter_type  all_counters[] = {
+  { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "cache-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+  { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+  { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+};
+#define N_ALL (sizeof(all_counters)/sizeof(all_counters[0]))
+
+/* the counters which can be used on this system */
+static const struct counter_type *counters[MAX_COUNTERS];
+static int  n_counters;
+
+static int
+open_counter(const struct counter_type *ct, pid_t pid)
+{
+  struct perf_event_attr  attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = ct->type;
+  attr.config = ct->config;
+  attr.read_format = (PERF_FORMAT_TOTAL_TIME_ENABLED
+		      | PERF_FORMAT_TOTAL_TIME_RUNNING);
+  attr.disabled = 1;
+  attr.enable_on_exec = 1;
+  attr.inherit = 1;
+  /* software events like context switches happen in the kernel */
+  if (ct->type == PERF_TYPE_HARDWARE) {
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+  }
+  return syscall(__NR_perf_event_open, &attr, pid, -1, -1,
+		 PERF_FLAG_FD_CLOEXEC);
+}
+
+int
+counters_init(void)
+/* Find out which counters are available.  Return the number of
+ * available counters, or -1 if none can be used.  */
+{
+  size_t  i;
+  int  fd;
+
+  n_counters = 0;
+  for (i=0; i<N_ALL && n_counters<MAX_COUNTERS; ++i) {
+    fd = open_counter(all_counters+i, 0);
+    if (fd < 0)
+      continue;
+    close(fd);
+    counters[n_counters++] = all_counters+i;
+  }
+  if (n_counters == 0)
+    return -1;
+  return n_counters;
+}
+
+const char *
+counter_name(int i)
+{
+  return counters[i]->name;
+}
+
+int
+counters_attach(struct job *job)
+/* Attach the available counters to the process 'job->pid', which must
+ * not have called exec() yet.  Return 0 on success and -1 on error.  */
+{
+  int  i;
+
+  for (i=0; i<n_counters; ++i) {
+    job->counter_fd[i] = open_counter(counters[i], job->pid);
+    if (job->counter_fd[i] < 0) {
+      while (--i >= 0) {
+	close(job->counter_fd[i]);
+	job->counter_fd[i] = -1;
+      }
+      return -1;
+    }
+  }
+  job->n_counters = n_counters;
+  return 0;
+}
+
+void
+counters_collect(struct job *job)
+/* Read the final values of the counters of JOB and close them.  If a
+ * counter was not always active, because the hardware has fewer
+ * counters than requested, the value is scaled up accordingly.  */
+{
+  uint64_t  buf[3];		/* value, time enabled, time running */
+  int  i;
+
+  for (i=0; i<job->n_counters; ++i) {
+    job->counter[i] = 0;
+    if (job->counter_fd[i] < 0)
+      continue;
+    if (read(job->counter_fd[i], buf, sizeof(buf)) == sizeof(buf)) {
+      if (buf[2] > 0 && buf[2] < buf[1])
+	buf[0] = (double)buf[0] * buf[1] / buf[2];
+      job->counter[i] = buf[0];
+    }
+    close(job->counter_fd[i]);
+    job->counter_fd[i] = -1;
+  }
+}
+
+#else /* ! HAVE_LINUX_PERF_EVENT_H */
+
+int
+counters_init(void)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+const char *
+counter_name(int i)
+{
+  return NULL;
+}
+
+int
+counters_attach(struct job *job)
+{
+  errno = ENOSYS;
+  return -1;
+}
+
+void
+counters_collect(struct job *job)
+{
+}
+
+#endif /* ! HAVE_LINUX_PERF_EVENT_H */
@@ -0,0 +1,550 @@
+/* decompress.c - read compressed command files
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The compression format is detected from the first bytes of the
+ * file.  Each supported format is only compiled in, if the configure
+ * script found the corresponding library.  If threads are available,
+ * decompression runs in a helper thread, so that it overlaps with
+ * starting and reaping the jobs.  Errors are recorded by the decoder
+ * and reported by 'dstream_read', in the thread which reads the
+ * data.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <assert.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "parallel.h"
+
+
+#define IN_SIZE (256*1024)
+
+struct codec {
+  const char *name;
+  const unsigned char *magic;
+  size_t  magic_len;
+  int  (*open)(struct dstream *ds);
+  int  (*step)(struct dstream *ds, unsigned char *out, size_t len,
+	       size_t *produced);
+  void  (*close)(struct dstream *ds);
+};
+
+struct dstream {
+  const struct codec *codec;
+  int  fd;
+  unsigned char *in;
+  size_t  in_pos, in_len;
+  int  in_eof;
+  int  finished;
+  char  err_msg[64];		/* what went wrong, if decoding failed */
+  int  err_errno;		/* errno for ERR_MSG, or 0 */
+  int  err_reported;
+  union {
+#ifdef HAVE_ZLIB
+    z_stream  z;
+#endif
+#ifdef HAVE_LZMA
+    lzma_stream  x;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+    int  dummy;
+  } u;
+#ifdef HAVE_PTHREAD
+  pthread_t  thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t  cond;
+  struct chunk *queue, **queue_tail;
+  int  n_queued;
+  int  thread_done;		/* 1 at end of data, -1 on error */
+  int  stop;
+  struct chunk *current;
+#endif
+};
+
+
+/**********************************************************************
+ * gzip, via zlib
+ */
+
+#ifdef HAVE_ZLIB
+static int
+gzip_open(struct dstream *ds)
+{
+  memset(&ds->u.z, 0, sizeof(ds->u.z));
+  /* 15+32: accept gzip and zlib headers */
+  return inflateInit2(&ds->u.z, 15+32) == Z_OK ? 0 : -1;
+}
+
+static int
+gzip_step(struct dstream *ds, unsigned char *out, size_t len,
+	  size_t *produced)
+{
+  z_stream *z = &ds->u.z;
+  int  rc;
+
+  if (ds->finished) {
+    /* gzip files may consist of several concatenated members */
+    if (ds->in_pos == ds->in_len)
+      return ds->in_eof ? 1 : 0;
+    inflateReset(z);
+    ds->finished = 0;
+  }
+
+  z->next_in = ds->in + ds->in_pos;
+  z->avail_in = ds->in_len - ds->in_pos;
+  z->next_out = out;
+  z->avail_out = len;
+  rc = inflate(z, Z_NO_FLUSH);
+  *produced = len - z->avail_out;
+  ds->in_pos = ds->in_len - z->avail_in;
+  if (rc == Z_STREAM_END) {
+    ds->finished = 1;
+    return 0;
+  }
+  if (rc == Z_OK || rc == Z_BUF_ERROR)
+    return 0;
+  return -1;
+}
+
+static void
+gzip_close(struct dstream *ds)
+{
+  inflateEnd(&ds->u.z);
+}
+#endif
+
+
+/**********************************************************************
+ * xz, via liblzma
+ */
+
+#ifdef HAVE_LZMA
+static int
+xz_open(struct dstream *ds)
+{
+  lzma_stream  init = LZMA_STREAM_INIT;
+
+  ds->u.x = init;
+  return lzma_stream_decoder(&ds->u.x, UINT64_MAX,
+			     LZMA_CONCATENATED) == LZMA_OK ? 0 : -1;
+}
+
+static int
+xz_step(struct dstream *ds, unsigned char *out, size_t len,
+	size_t *produced)
+{
+  lzma_stream *x = &ds->u.x;
+  lzma_ret  rc;
+
+  x->next_in = ds->in + ds->in_pos;
+  x->avail_in = ds->in_len - ds->in_pos;
+  x->next_out = out;
+  x->avail_out = len;
+  rc = lzma_code(x, ds->in_eof ? LZMA_FINISH : LZMA_RUN);
+  *produced = len - x->avail_out;
+  ds->in_pos = ds->in_len - x->avail_in;
+  if (rc == LZMA_STREAM_END)
+    return *produced ? 0 : 1;
+  if (rc == LZMA_OK || rc == LZMA_BUF_ERROR)
+    return 0;
+  return -1;
+}
+
+static void
+xz_close(struct dstream *ds)
+{
+  lzma_end(&ds->u.x);
+}
+#endif
+
+
+/**********************************************************************
+ * zstd, via libzstd
+ */
+
+#ifdef HAVE_ZSTD
+static int
+zstd_open(struct dstream *ds)
+{
+  ds->u.zstd = ZSTD_createDStream();
+  if (! ds->u.zstd)
+    return -1;
+  return ZSTD_isError(ZSTD_initDStream(ds->u.zstd)) ? -1 : 0;
+}
+
+static int
+zstd_step(struct dstream *ds, unsigned char *out, size_t len,
+	  size_t *produced)
+{
+  ZSTD_inBuffer  in;
+  ZSTD_outBuffer  o;
+  size_t  rc;
+
+  in.src = ds->in;
+  in.size = ds->in_len;
+  in.pos = ds->in_pos;
+  o.dst = out;
+  o.size = len;
+  o.pos = 0;
+  rc = ZSTD_decompressStream(ds->u.zstd, &o, &in);
+  *produced = o.pos;
+  ds->in_pos = in.pos;
+  if (ZSTD_isError(rc))
+    return -1;
+  /* rc == 0 means that a frame is complete; more frames may follow */
+  ds->finished = (rc == 0);
+  if (ds->finished && ds->in_eof && ds->in_pos == ds->in_len && ! o.pos)
+    return 1;
+  return 0;
+}
+
+static void
+zstd_close(struct dstream *ds)
+{
+  ZSTD_freeDStream(ds->u.zstd);
+}
+#endif
+
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+static const unsigned char xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+static const struct codec codecs[] = {
+#ifdef HAVE_ZLIB
+  { "gzip", gzip_magic, sizeof(gzip_magic), gzip_open, gzip_step, gzip_close },
+#else
+  { "gzip", gzip_magic, sizeof(gzip_magic), NULL, NULL, NULL },
+#endif
+#ifdef HAVE_LZMA
+  { "xz", xz_magic, sizeof(xz_magic), xz_open, xz_step, xz_close },
+#else
+  { "xz", xz_magic, sizeof(xz_magic), NULL, NULL, NULL },
+#endif
+#ifdef HAVE_ZSTD
+  { "zstd", zstd_magic, sizeof(zstd_magic), zstd_open, zstd_step, zstd_close },
+#else
+  { "zstd", zstd_magic, sizeof(zstd_magic), NULL, NULL, NULL },
+#endif
+};
+#define N_CODECS (sizeof(codecs)/sizeof(codecs[0]))
+
+
+static void
+dstream_fail(struct dstream *ds, int errnum, const char *what)
+/* Record an error, to be reported by 'dstream_read'.  */
+{
+  snprintf(ds->err_msg, sizeof(ds->err_msg), what, ds->codec->name);
+  ds->err_errno = errnum;
+}
+
+static ssize_t
+dstream_decode(struct dstream *ds, void *out, size_t len)
+/* Decompress up to LEN bytes into OUT.  Return the number of bytes
+ * produced, 0 at the end of the data, or -1 on error.  */
+{
+  for (;;) {
+    size_t  produced = 0;
+    int  rc;
+
+    if (ds->in_pos == ds->in_len && ! ds->in_eof) {
+      ssize_t  n;
+#ifdef HAVE_PTHREAD
+      /* the helper thread can only be cancelled while it waits for
+       * input */
+      int  state;
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+      n = read(ds->fd, ds->in, IN_SIZE);
+      pthread_setcancelstate(state, NULL);
+#else
+      n = read(ds->fd, ds->in, IN_SIZE);
+#endif
+      if (n < 0 && errno == EINTR)
+	continue;
+      if (n < 0) {
+	dstream_fail(ds, errno, "read from %s command file failed");
+	return -1;
+      }
+      ds->in_pos = 0;
+      ds->in_len = n;
+      if (n == 0)
+	ds->in_eof = 1;
+    }
+
+    rc = ds->codec->step(ds, out, len, &produced);
+    if (rc < 0) {
+      dstream_fail(ds, 0, "corrupt %s data in command file");
+      return -1;
+    }
+    if (produced > 0)
+      return produced;
+    if (rc > 0)
+      return 0;
+    if (ds->in_eof && ds->in_pos == ds->in_len) {
+      if (ds->finished)
+	return 0;
+      dstream_fail(ds, 0, "truncated %s data in command file");
+      return -1;
+    }
+  }
+}
+
+
+/**********************************************************************
+ * the helper thread
+ */
+
+#ifdef HAVE_PTHREAD
+
+#define CHUNK_SIZE (1024*1024)
+#define MAX_CHUNKS 4
+
+struct chunk {
+  struct chunk *next;
+  size_t  pos, len;
+  char  data[CHUNK_SIZE];
+};
+
+static void *
+dstream_thread(void *arg)
+{
+  struct dstream *ds = arg;
+  struct chunk *chunk;
+  int  done = 0;
+
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  while (! done) {
+    chunk = xnew(struct chunk, 1);
+    chunk->next = NULL;
+    chunk->pos = chunk->len = 0;
+    while (chunk->len < CHUNK_SIZE) {
+      ssize_t  n = dstream_decode(ds, chunk->data + chunk->len,
+				  CHUNK_SIZE - chunk->len);
+      if (n <= 0) {
+	done = n < 0 ? -1 : 1;
+	break;
+      }
+      chunk->len += n;
+    }
+
+    pthread_mutex_lock(&ds->lock);
+    while (ds->n_queued >= MAX_CHUNKS && ! ds->stop)
+      pthread_cond_wait(&ds->cond, &ds->lock);
+    if (ds->stop) {
+      pthread_mutex_unlock(&ds->lock);
+      xfree(chunk);
+      break;
+    }
+    *ds->queue_tail = chunk;
+    ds->queue_tail = &chunk->next;
+    ++ds->n_queued;
+    ds->thread_done = done;
+    pthread_cond_broadcast(&ds->cond);
+    pthread_mutex_unlock(&ds->lock);
+  }
+  return NULL;
+}
+
+static struct chunk *
+dstream_next_chunk(struct dstream *ds, int *done_p)
+{
+  struct chunk *chunk;
+
+  pthread_mutex_lock(&ds->lock);
+  while (! ds->queue && ! ds->thread_done)
+    pthread_cond_wait(&ds->cond, &ds->lock);
+  chunk = ds->queue;
+  if (chunk) {
+    ds->queue = chunk->next;
+    if (! ds->queue)
+      ds->queue_tail = &ds->queue;
+    --ds->n_queued;
+    pthread_cond_broadcast(&ds->cond);
+  }
+  *done_p = ds->thread_done;
+  pthread_mutex_unlock(&ds->lock);
+  return chunk;
+}
+
+#endif /* HAVE_PTHREAD */
+
+
+/**********************************************************************
+ * global functions
+ */
+
+const char *
+compression_format(const void *lead, size_t len)
+/* Return the name of the compression format which uses the magic
+ * number at the start of LEAD, or NULL if LEAD looks uncompressed.  */
+{
+  unsigned  i;
+
+  for (i=0; i<N_CODECS; ++i) {
+    if (len >= codecs[i].magic_len
+	&& memcmp(lead, codecs[i].magic, codecs[i].magic_len) == 0)
+      return codecs[i].name;
+  }
+  return NULL;
+}
+
+struct dstream *
+new_dstream(int fd, const void *lead, size_t len)
+/* Prepare to decompress the data read from FD.  The first LEN bytes of
+ * the data have already been read and are given in LEAD.  Return NULL
+ * if the data is not compressed, or if support for the compression
+ * format is not compiled in.  */
+{
+  const struct codec *codec = NULL;
+  struct dstream *ds;
+  unsigned  i;
+
+  for (i=0; i<N_CODECS; ++i) {
+    if (len >= codecs[i].magic_len
+	&& memcmp(lead, codecs[i].magic, codecs[i].magic_len) == 0)
+      codec = codecs+i;
+  }
+  if (! codec || ! codec->open)
+    return NULL;
+
+  ds = xnew(struct dstream, 1);
+  ds->codec = codec;
+  ds->fd = fd;
+  ds->in = xnew(unsigned char, IN_SIZE);
+  assert(len <= IN_SIZE);
+  memcpy(ds->in, lead, len);
+  ds->in_pos = 0;
+  ds->in_len = len;
+  ds->in_eof = 0;
+  ds->finished = 0;
+  ds->err_msg[0] = '\0';
+  ds->err_errno = 0;
+  ds->err_reported = 0;
+  if (codec->open(ds) < 0) {
+    xfree(ds->in);
+    xfree(ds);
+    return NULL;
+  }
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&ds->lock, NULL);
+  pthread_cond_init(&ds->cond, NULL);
+  ds->queue = NULL;
+  ds->queue_tail = &ds->queue;
+  ds->n_queued = 0;
+  ds->thread_done = 0;
+  ds->stop = 0;
+  ds->current = NULL;
+  if (pthread_create(&ds->thread, NULL, dstream_thread, ds) != 0)
+    fatal("error: cannot create decompression thread");
+#endif
+  return ds;
+}
+
+void
+delete_dstream(struct dstream *ds)
+{
+#ifdef HAVE_PTHREAD
+  struct chunk *chunk;
+
+  pthread_mutex_lock(&ds->lock);
+  ds->stop = 1;
+  pthread_cond_broadcast(&ds->cond);
+  if (! ds->thread_done)
+    pthread_cancel(ds->thread);
+  pthread_mutex_unlock(&ds->lock);
+  pthread_join(ds->thread, NULL);
+  xfree(ds->current);
+  while ((chunk = ds->queue)) {
+    ds->queue = chunk->next;
+    xfree(chunk);
+  }
+  pthread_cond_destroy(&ds->cond);
+  pthread_mutex_destroy(&ds->lock);
+#endif
+  ds->codec->close(ds);
+  xfree(ds->in);
+  xfree(ds);
+}
+
+static ssize_t
+dstream_report(struct dstream *ds)
+/* Emit the message for the error recorded by the decoder, once, and
+ * return -1 with errno set.  */
+{
+  if (! ds->err_reported) {
+    ds->err_reported = 1;
+    errno = ds->err_errno;
+    if (ds->err_errno)
+      error("error: %s (%m)", ds->err_msg);
+    else
+      error("error: %s", ds->err_msg);
+  }
+  errno = ds->err_errno ? ds->err_errno : EIO;
+  return -1;
+}
+
+ssize_t
+dstream_read(struct dstream *ds, void *buf, size_t len)
+/* Read up to LEN bytes of decompressed data into BUF.  Return the
+ * number of bytes read, 0 at the end of the data, or -1 on error.  All
+ * data decoded before an error is returned first.  */
+{
+#ifdef HAVE_PTHREAD
+  struct chunk *chunk;
+  size_t  n;
+  int  done;
+
+  while (! ds->current || ds->current->pos == ds->current->len) {
+    xfree(ds->current);
+    /* the lock orders the error fields before DONE */
+    ds->current = dstream_next_chunk(ds, &done);
+    if (! ds->current)
+      return done < 0 ? dstream_report(ds) : 0;
+  }
+  chunk = ds->current;
+  n = chunk->len - chunk->pos;
+  if (n > len)
+    n = len;
+  memcpy(buf, chunk->data + chunk->pos, n);
+  chunk->pos += n;
+  return n;
+#else
+  ssize_t  n = dstream_decode(ds, buf, len);
+  return n < 0 ? dstream_report(ds) : n;
+#endif
+}
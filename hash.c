@@ -0,0 +1,135 @@
+/* hash.c - a fast, non-cryptographic 128 bit hash function
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The algorithm is MurmurHash3 (x64, 128 bit variant) by Austin
+ * Appleby, rearranged to allow for incremental updates.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "parallel.h"
+
+
+#define C1 0x87c37b91114253d5ULL
+#define C2 0x4cf5ad432745937fULL
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+fmix64(uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static uint64_t
+load64(const unsigned char *p)
+{
+  return ((uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+	  | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32
+	  | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48
+	  | (uint64_t)p[7] << 56);
+}
+
+static void
+hash_block(struct hash *h, const unsigned char *p)
+{
+  uint64_t  k1 = load64(p);
+  uint64_t  k2 = load64(p+8);
+
+  k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h->h1 ^= k1;
+  h->h1 = rotl64(h->h1, 27); h->h1 += h->h2; h->h1 = h->h1*5+0x52dce729;
+  k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h->h2 ^= k2;
+  h->h2 = rotl64(h->h2, 31); h->h2 += h->h1; h->h2 = h->h2*5+0x38495ab5;
+}
+
+void
+hash_init(struct hash *h)
+{
+  h->h1 = h->h2 = 0;
+  h->len = 0;
+}
+
+void
+hash_update(struct hash *h, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  size_t  used = h->len % 16;
+
+  h->len += len;
+  if (used) {
+    size_t  n = 16 - used;
+    if (n > len)  n = len;
+    memcpy(h->buf+used, p, n);
+    p += n;
+    len -= n;
+    if (used+n < 16)
+      return;
+    hash_block(h, h->buf);
+  }
+  while (len >= 16) {
+    hash_block(h, p);
+    p += 16;
+    len -= 16;
+  }
+  memcpy(h->buf, p, len);
+}
+
+void
+hash_final(struct hash *h, char *hex)
+/* Finish the computation and store the hash value as 32 hexadecimal
+ * digits, followed by a terminating NUL character, in HEX.  */
+{
+  uint64_t  h1 = h->h1, h2 = h->h2;
+  uint64_t  k1 = 0, k2 = 0;
+  size_t  tail = h->len % 16;
+
+  if (tail > 0) {
+    unsigned char  t[16];
+    memset(t, 0, 16);
+    memcpy(t, h->buf, tail);
+    k1 = load64(t);
+    k2 = load64(t+8);
+  }
+  if (tail > 8) {
+    k2 *= C2; k2 = rotl64(k2, 33); k2 *= C1; h2 ^= k2;
+  }
+  if (tail > 0) {
+    k1 *= C1; k1 = rotl64(k1, 31); k1 *= C2; h1 ^= k1;
+  }
+
+  h1 ^= h->len; h2 ^= h->len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+
+  sprintf(hex, "%016llx%016llx",
+	  (unsigned long long)h1, (unsigned long long)h2);
+}
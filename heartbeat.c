@@ -0,0 +1,169 @@
+/* heartbeat.c - let jobs report that they are alive
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* All jobs share one end of a datagram socket pair, which they inherit
+ * from parallel; every write to it becomes one message.  The kernel
+ * attaches the process ID of the writer to each message, so that the
+ * pool can tell which job is alive, even if the message comes from a
+ * child process of the job.  Since only one file descriptor needs to
+ * be watched, this works for any number of jobs.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "parallel.h"
+
+
+int
+parse_heartbeat_policy(const char *arg, struct heartbeat_policy *policy)
+/* Parse a policy of the form "SECONDS[,retry=N]".  Return 0 on success
+ * and -1 on error.  */
+{
+  char *tail;
+  const char *ptr;
+
+  policy->timeout = strtod(arg, &tail);
+  if (tail == arg || policy->timeout <= 0)
+    return -1;
+  policy->retries = 0;
+  if (strncmp(tail, ",retry=", 7) == 0) {
+    ptr = tail+7;
+    errno = 0;
+    policy->retries = strtol(ptr, &tail, 10);
+    if (tail == ptr || errno || policy->retries < 0)
+      return -1;
+  }
+  if (*tail != '\0')
+    return -1;
+  return 0;
+}
+
+int
+open_heartbeat(int fd[2])
+/* Create the heartbeat channel.  FD[0] is read by the pool, FD[1] is
+ * inherited by the jobs.  Return 0 on success and -1 on error, with
+ * errno set.  */
+{
+#ifdef SO_PASSCRED
+  int  on = 1;
+
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fd) < 0)
+    return -1;
+  if (setsockopt(fd[0], SOL_SOCKET, SO_PASSCRED, &on, sizeof(on)) < 0) {
+    int  saved_errno = errno;
+    close(fd[0]);
+    close(fd[1]);
+    errno = saved_errno;
+    return -1;
+  }
+  fcntl(fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fd[0], F_SETFL, O_NONBLOCK);
+  /* the jobs write into the socket, they never read from it */
+  shutdown(fd[1], SHUT_RD);
+  return 0;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static double
+parse_progress(const char *msg)
+/* Return the fraction done given by the last line of MSG which
+ * consists of a number between 0 and 100, optionally followed by '%',
+ * or -1 if there is no such line.  */
+{
+  const char *line, *end;
+  double  progress = -1, x;
+  char *tail;
+
+  for (line = msg; *line; line = *end ? end+1 : end) {
+    end = strchr(line, '\n');
+    if (! end)
+      end = line + strlen(line);
+    x = strtod(line, &tail);
+    if (tail == line || ! (x >= 0 && x <= 100))
+      continue;
+    if (*tail == '%')
+      ++tail;
+    while (tail < end && (*tail == ' ' || *tail == '\t' || *tail == '\r'))
+      ++tail;
+    if (tail == end)
+      progress = x / 100;
+  }
+  return progress;
+}
+
+int
+read_heartbeat(int fd, pid_t *pid_p, double *progress_p)
+/* Read one message from the heartbeat channel FD.  Store the process
+ * ID of the writer in *PID_P, and the fraction done reported in the
+ * message, or -1, in *PROGRESS_P.  Return 1 if a message was read, 0
+ * if none is available, and -1 on error.  */
+{
+#ifdef SO_PASSCRED
+  char  buffer[256];
+  union {
+    char  buf[CMSG_SPACE(sizeof(struct ucred))];
+    struct cmsghdr  align;
+  } control;
+  struct msghdr  msg;
+  struct cmsghdr *cmsg;
+  struct iovec  iov;
+  struct ucred  cred;
+  ssize_t  n;
+
+  iov.iov_base = buffer;
+  iov.iov_len = sizeof(buffer)-1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  n = recvmsg(fd, &msg, MSG_DONTWAIT);
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return 0;
+    return -1;
+  }
+  buffer[n] = '\0';
+
+  *pid_p = 0;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET
+	&& cmsg->cmsg_type == SCM_CREDENTIALS) {
+      memcpy(&cred, CMSG_DATA(cmsg), sizeof(cred));
+      *pid_p = cred.pid;
+    }
+  }
+  *progress_p = parse_progress(buffer);
+  return 1;
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
@@ -0,0 +1,252 @@
+/* index.c - byte offsets of the commands in a command file
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The index records the total number of commands in a file and the
+ * byte offset of every INDEX_STRIDE-th command, so that a reader can
+ * seek close to any given command.  Commands are counted like 'cf_next'
+ * counts them: blank lines are skipped, and an incomplete last line
+ * does not count.
+ *
+ * The index can be kept in a sidecar file FNAME.idx.  This is a text
+ * file, so that it can be shared between machines:
+ *
+ *     parallel-index 1 SIZE MTIME_SEC MTIME_NSEC COMMANDS STRIDE
+ *     OFFSET
+ *     ...
+ *
+ * The index is only used if the size and modification time still match
+ * the command file.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "parallel.h"
+
+
+#define INDEX_STRIDE 1024
+
+struct cf_index {
+  long  n_cmds;
+  long  n_offsets;
+  off_t *offsets;		/* offset of command i*INDEX_STRIDE */
+};
+
+
+static struct cf_index *
+build_index(int fd)
+/* Read the file FD in a single pass and record the command offsets.  */
+{
+  struct cf_index *idx;
+  long  allocated = 64;
+  char *buffer;
+  off_t  base = 0, start = 0;
+  int  in_cmd = 0;
+  ssize_t  n;
+
+  idx = xnew(struct cf_index, 1);
+  idx->n_cmds = 0;
+  idx->n_offsets = 0;
+  idx->offsets = xnew(off_t, allocated);
+
+  buffer = xnew(char, 1024*1024);
+  while ((n = read(fd, buffer, 1024*1024)) != 0) {
+    char *ptr = buffer, *end;
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      xfree(buffer);
+      close_index(idx);
+      return NULL;
+    }
+    end = buffer + n;
+    while (ptr < end) {
+      if (! in_cmd) {
+	while (ptr < end && isspace(*ptr))
+	  ++ptr;
+	if (ptr == end)
+	  break;
+	start = base + (ptr - buffer);
+	in_cmd = 1;
+      }
+      ptr = memchr(ptr, '\n', end - ptr);
+      if (! ptr)
+	break;
+      ++ptr;
+      in_cmd = 0;
+      if (idx->n_cmds % INDEX_STRIDE == 0) {
+	if (idx->n_offsets == allocated) {
+	  allocated *= 2;
+	  idx->offsets = xrenew(off_t, idx->offsets, allocated);
+	}
+	idx->offsets[idx->n_offsets++] = start;
+      }
+      ++idx->n_cmds;
+    }
+    base += n;
+  }
+  xfree(buffer);
+  return idx;
+}
+
+static struct cf_index *
+read_index(const char *path, const struct stat *st)
+/* Load the sidecar file PATH, if it matches the file described by
+ * ST.  */
+{
+  struct cf_index *idx;
+  unsigned long long  size, sec, nsec, offset;
+  long  n_cmds, stride, i;
+  FILE *f;
+
+  f = fopen(path, "r");
+  if (! f)
+    return NULL;
+  if (fscanf(f, "parallel-index 1 %llu %llu %llu %ld %ld\n",
+	     &size, &sec, &nsec, &n_cmds, &stride) != 5
+      || size != (unsigned long long)st->st_size
+      || sec != (unsigned long long)st->st_mtim.tv_sec
+      || nsec != (unsigned long long)st->st_mtim.tv_nsec
+      || stride != INDEX_STRIDE || n_cmds < 0) {
+    fclose(f);
+    return NULL;
+  }
+
+  idx = xnew(struct cf_index, 1);
+  idx->n_cmds = n_cmds;
+  idx->n_offsets = (n_cmds + INDEX_STRIDE - 1) / INDEX_STRIDE;
+  idx->offsets = xnew(off_t, idx->n_offsets + 1);
+  for (i=0; i<idx->n_offsets; ++i) {
+    if (fscanf(f, "%llu\n", &offset) != 1 || offset >= size) {
+      fclose(f);
+      close_index(idx);
+      return NULL;
+    }
+    idx->offsets[i] = offset;
+  }
+  fclose(f);
+  return idx;
+}
+
+static void
+write_index(const char *path, const struct stat *st,
+	    const struct cf_index *idx)
+{
+  char *tmp_path;
+  FILE *f;
+  long  i;
+
+  asprintf(&tmp_path, "%s.%d", path, (int)getpid());
+  f = fopen(tmp_path, "w");
+  if (! f) {
+    warning("warning: cannot write index \"%s\" (%m)", path);
+    free(tmp_path);
+    return;
+  }
+  fprintf(f, "parallel-index 1 %llu %llu %llu %ld %d\n",
+	  (unsigned long long)st->st_size,
+	  (unsigned long long)st->st_mtim.tv_sec,
+	  (unsigned long long)st->st_mtim.tv_nsec,
+	  idx->n_cmds, INDEX_STRIDE);
+  for (i=0; i<idx->n_offsets; ++i)
+    fprintf(f, "%llu\n", (unsigned long long)idx->offsets[i]);
+  if (fclose(f) == 0) {
+    rename(tmp_path, path);
+  } else {
+    warning("warning: cannot write index \"%s\" (%m)", path);
+    unlink(tmp_path);
+  }
+  free(tmp_path);
+}
+
+struct cf_index *
+open_index(const char *fname, int use_sidecar)
+/* Return the index of the command file FNAME.  If USE_SIDECAR is set,
+ * the index is read from FNAME.idx if this is up to date, and is
+ * written there otherwise.  On error, NULL is returned and errno is
+ * set.  */
+{
+  struct cf_index *idx = NULL;
+  struct stat  st;
+  char *path = NULL;
+  int  fd;
+
+  fd = open(fname, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  if (use_sidecar) {
+    asprintf(&path, "%s.idx", fname);
+    idx = read_index(path, &st);
+  }
+  if (! idx) {
+    idx = build_index(fd);
+    if (idx && path)
+      write_index(path, &st, idx);
+  }
+  free(path);
+  close(fd);
+  return idx;
+}
+
+void
+close_index(struct cf_index *idx)
+{
+  xfree(idx->offsets);
+  xfree(idx);
+}
+
+long
+index_commands(const struct cf_index *idx)
+/* Return the number of commands in the file.  */
+{
+  return idx->n_cmds;
+}
+
+off_t
+index_seek(const struct cf_index *idx, long cmd, long *found_p)
+/* Return the offset of the last indexed command before command CMD
+ * (counting from 0), and store the number of this command in
+ * *FOUND_P.  */
+{
+  long  i;
+
+  if (cmd <= 0 || idx->n_offsets == 0) {
+    *found_p = 0;
+    return idx->n_offsets > 0 ? idx->offsets[0] : 0;
+  }
+  i = cmd / INDEX_STRIDE;
+  if (i >= idx->n_offsets)
+    i = idx->n_offsets - 1;
+  *found_p = i * INDEX_STRIDE;
+  return idx->offsets[i];
+}
@@ -0,0 +1,273 @@
+/* jobserver.c - share job slots with GNU make
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The GNU make jobserver is a pipe (or, since make 4.4, a named FIFO)
+ * which contains one byte for every free job slot.  Every process
+ * taking part owns one implicit slot; in order to run more than one
+ * job at a time, it reads one byte for every additional job and
+ * writes the byte back once the job has finished.  The jobserver is
+ * advertised to child processes via the MAKEFLAGS environment
+ * variable, either as "--jobserver-auth=R,W" (file descriptors of the
+ * pipe) or as "--jobserver-auth=fifo:PATH".  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "parallel.h"
+
+
+struct jobserver {
+  int  read_fd, write_fd;	/* read_fd is non-blocking */
+  int  pipe_fd;			/* read end exported to children, or -1 */
+  char *fifo;			/* FIFO to remove on exit, or NULL */
+  char *tokens;			/* the bytes read from the jobserver */
+  long  held, allocated;
+};
+
+
+static struct jobserver *
+new_js(int read_fd, int write_fd)
+{
+  struct jobserver *js;
+
+  js = xnew(struct jobserver, 1);
+  js->read_fd = read_fd;
+  js->write_fd = write_fd;
+  js->pipe_fd = -1;
+  js->fifo = NULL;
+  js->tokens = NULL;
+  js->held = js->allocated = 0;
+  return js;
+}
+
+static int
+open_private(int fd)
+/* Open a new, non-blocking file description for the pipe FD, so that
+ * the file status flags seen by other processes are not changed.  */
+{
+  char  path[64];
+  int  res;
+
+  sprintf(path, "/proc/self/fd/%d", fd);
+  res = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+  if (res < 0) {
+    /* Fall back to the shared file description.  A token may be
+     * taken by another process between poll() and read(), but
+     * then make itself is blocked in read() and nothing is lost.  */
+    res = dup(fd);
+    if (res >= 0) {
+      fcntl(res, F_SETFD, FD_CLOEXEC);
+      fcntl(res, F_SETFL, fcntl(res, F_GETFL) | O_NONBLOCK);
+    }
+  }
+  return res;
+}
+
+struct jobserver *
+jobserver_from_env(void)
+/* If MAKEFLAGS advertises a jobserver, connect to it.  Return NULL if
+ * there is no usable jobserver.  */
+{
+  const char *flags = getenv("MAKEFLAGS");
+  const char *auth = NULL, *ptr;
+  char *value;
+  size_t  len;
+  int  rfd, wfd;
+  struct jobserver *js = NULL;
+
+  if (! flags)
+    return NULL;
+  /* later options override earlier ones */
+  for (ptr = flags; (ptr = strstr(ptr, "--jobserver-")); ++ptr) {
+    if (strncmp(ptr, "--jobserver-auth=", 17) == 0)
+      auth = ptr+17;
+    else if (strncmp(ptr, "--jobserver-fds=", 16) == 0)
+      auth = ptr+16;
+  }
+  if (! auth)
+    return NULL;
+
+  len = strcspn(auth, " \t");
+  value = xnew(char, len+1);
+  memcpy(value, auth, len);
+  value[len] = '\0';
+
+  if (strncmp(value, "fifo:", 5) == 0) {
+    rfd = open(value+5, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+    wfd = open(value+5, O_WRONLY|O_CLOEXEC);
+    if (rfd >= 0 && wfd >= 0) {
+      js = new_js(rfd, wfd);
+    } else {
+      warning("warning: cannot open jobserver FIFO \"%s\" (%m)", value+5);
+      if (rfd >= 0)  close(rfd);
+      if (wfd >= 0)  close(wfd);
+    }
+  } else if (sscanf(value, "%d,%d", &rfd, &wfd) == 2 && rfd >= 0 && wfd >= 0) {
+    if (fcntl(rfd, F_GETFD) < 0 || fcntl(wfd, F_GETFD) < 0) {
+      warning("warning: jobserver unavailable,"
+	      " prefix the make rule with '+' to share job slots");
+    } else {
+      int  private_fd = open_private(rfd);
+      if (private_fd >= 0)
+	js = new_js(private_fd, wfd);
+    }
+  }
+  xfree(value);
+  return js;
+}
+
+struct jobserver *
+new_jobserver(long slots, int use_fifo)
+/* Create a jobserver with SLOTS job slots, one of which is the
+ * implicit slot of parallel itself, and advertise it to child
+ * processes via MAKEFLAGS.  Return NULL on error.  */
+{
+  struct jobserver *js;
+  const char *old_flags;
+  char *flags, *auth;
+  char  plus = '+';
+  long  i;
+
+  if (use_fifo) {
+    const char *tmp = getenv("TMPDIR");
+    char *fifo;
+    int  fd;
+
+    asprintf(&fifo, "%s/parallel-js.%d", tmp ? tmp : "/tmp", (int)getpid());
+    if (mkfifo(fifo, 0600) < 0) {
+      free(fifo);
+      return NULL;
+    }
+    /* O_RDWR keeps the FIFO open when all clients have gone */
+    fd = open(fifo, O_RDWR|O_NONBLOCK|O_CLOEXEC);
+    if (fd < 0) {
+      unlink(fifo);
+      free(fifo);
+      return NULL;
+    }
+    js = new_js(fd, fd);
+    js->fifo = xstrdup(fifo);
+    free(fifo);
+    asprintf(&auth, "fifo:%s", js->fifo);
+  } else {
+    int  fd[2];
+
+    if (pipe(fd) < 0)
+      return NULL;
+    /* the pipe is inherited by all children, the private read end is
+     * not */
+    js = new_js(open_private(fd[0]), fd[1]);
+    js->pipe_fd = fd[0];
+    asprintf(&auth, "%d,%d", fd[0], fd[1]);
+  }
+
+  for (i=1; i<slots; ++i) {
+    if (write(js->write_fd, &plus, 1) != 1) {
+      error("error: cannot initialise jobserver (%m)");
+      break;
+    }
+  }
+
+  old_flags = getenv("MAKEFLAGS");
+  asprintf(&flags, "%s -j --jobserver-auth=%s",
+	   old_flags ? old_flags : "", auth);
+  setenv("MAKEFLAGS", flags, 1);
+  free(flags);
+  free(auth);
+  return js;
+}
+
+void
+delete_jobserver(struct jobserver *js)
+/* Return all tokens and disconnect from the jobserver.  */
+{
+  while (js->held > 0)
+    jobserver_release(js);
+  if (js->fifo) {
+    unlink(js->fifo);
+    xfree(js->fifo);
+  }
+  close(js->read_fd);
+  if (js->write_fd != js->read_fd)
+    close(js->write_fd);
+  if (js->pipe_fd >= 0)
+    close(js->pipe_fd);
+  xfree(js->tokens);
+  xfree(js);
+}
+
+int
+jobserver_acquire(struct jobserver *js)
+/* Try to take one token from the jobserver, without blocking.  Return
+ * 1 if a token was obtained and 0 otherwise.  */
+{
+  char  token;
+  ssize_t  n;
+
+  do {
+    n = read(js->read_fd, &token, 1);
+  } while (n < 0 && errno == EINTR);
+  if (n != 1)
+    return 0;
+
+  if (js->held == js->allocated) {
+    js->allocated = js->allocated ? 2*js->allocated : 16;
+    js->tokens = xrenew(char, js->tokens, js->allocated);
+  }
+  js->tokens[js->held++] = token;
+  return 1;
+}
+
+void
+jobserver_release(struct jobserver *js)
+/* Give one token back to the jobserver.  */
+{
+  ssize_t  n;
+
+  if (js->held == 0)
+    return;
+  --js->held;
+  do {
+    n = write(js->write_fd, js->tokens + js->held, 1);
+  } while (n < 0 && errno == EINTR);
+  if (n != 1)
+    error("error: cannot return jobserver token (%m)");
+}
+
+long
+jobserver_held(const struct jobserver *js)
+{
+  return js->held;
+}
+
+int
+jobserver_fd(const struct jobserver *js)
+/* Return the file descriptor which becomes readable when tokens are
+ * available.  */
+{
+  return js->read_fd;
+}
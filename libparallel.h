@@ -0,0 +1,133 @@
+/* libparallel.h - run shell commands in parallel, from a C program
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* A pool runs the jobs submitted to it, using at most a given number
+ * of cpu slots at a time.  Typical use:
+ *
+ *     struct pool_config  cfg;
+ *     struct pool *pool;
+ *
+ *     pool_config_init(&cfg);
+ *     cfg.slots = 4;
+ *     pool = new_pool(&cfg);
+ *     pool_set_callback(pool, job_done, NULL);
+ *     pool_submit(pool, "make -C sub1");
+ *     pool_submit_argv(pool, argv);
+ *     pool_wait(pool);
+ *     delete_pool(pool);
+ *
+ * Instead of blocking in 'pool_wait', a program with its own event
+ * loop can wait for 'pool_fd' to become readable and then call
+ * 'pool_run' with a timeout of 0.
+ *
+ * The pool installs a handler for SIGCHLD.  Unless 'own_children' is
+ * set, only the children started by the pool are reaped.
+ *
+ * Errors are reported on stderr and through the return values;
+ * 'new_pool' returns NULL and 'pool_run' returns -1.  The library only
+ * exits the process if memory runs out.  All other symbols of the
+ * library start with "parallel_".  Link with the flags given by
+ * "pkg-config --libs libparallel", e.g. "-lparallel -lz -lpthread".  */
+
+#ifndef FILE_LIBPARALLEL_H_SEEN
+#define FILE_LIBPARALLEL_H_SEEN
+
+struct pool;
+
+struct pool_config {
+  long  slots;			/* cpu slots, 0 means number of cpus */
+  unsigned long long  memory;	/* bytes of memory, 0 means all */
+  long  lookahead;		/* pending jobs considered for packing */
+  const char *cache_dir;	/* result cache, or NULL */
+  unsigned long long  cache_size;
+  const char *results_dir;	/* per-job result files, or NULL */
+  const char *archive;		/* file for the output of all jobs, or NULL */
+  int  archive_compress;	/* compress the records of the archive */
+  const char *halt;		/* halt policy, e.g. "now,fail=10%" */
+  const char *jobserver;	/* "pipe" or "fifo" to export slots, "none"
+				   to ignore the jobserver of make */
+  const char *suspend;		/* e.g. "load=8", see parallel(1) */
+  const char *control;		/* FIFO for commands like "slots 4", or NULL */
+  int  verbosity;		/* 0: errors only, 1: job messages, 2: all */
+  int  handle_signals;		/* kill the jobs on SIGINT/SIGTERM/SIGHUP,
+				   dump the jobs on SIGUSR1, drain on SIGUSR2 */
+  int  own_children;		/* the pool starts all child processes */
+  int  spawners;		/* threads for starting jobs, 0 for none */
+  int  counters;		/* measure jobs with performance counters */
+  double  speculate;		/* start a second copy of jobs running this
+				   many times the median run time, or 0 */
+  int  nice;			/* nice level of the jobs (default 19) */
+  const char *sched;		/* scheduling policy: "other", "batch",
+				   "idle", or NULL to inherit */
+  const char *ionice;		/* I/O priority, e.g. "idle" or "be:7",
+				   or NULL to inherit */
+  const char *heartbeat;	/* "SECONDS[,retry=N]" to terminate jobs
+				   which stop sending heartbeats, or NULL */
+};
+
+struct pool_stats {
+  long  submitted;		/* jobs handed to the pool */
+  long  pending;		/* jobs waiting to be started */
+  long  running;		/* jobs currently running, including paused */
+  long  paused;			/* jobs stopped because the machine is busy */
+  long  done;			/* jobs which have finished */
+  long  failed;			/* finished jobs with non-zero status */
+  long  cached;			/* finished jobs replayed from the cache */
+  long  cancelled;		/* jobs cancelled before they ran */
+  long  backups;			/* second copies started for slow jobs */
+  long  backups_won;		/* second copies which finished first */
+  double  saved;		/* estimated seconds saved by the backups */
+  long  stalled;		/* jobs terminated for missing heartbeats */
+  long  requeued;		/* stalled jobs which were started again */
+  double  eta;			/* estimated seconds left, or -1 */
+  int  halted;			/* no new jobs are started */
+  int  on_hold;			/* dispatch is paused by 'pool_hold' */
+  int  signal;			/* signal which interrupted the run, or 0 */
+};
+
+/* The callback is called once for every job.  STATUS is the wait
+ * status of the job, or -1 if the job was never started.  */
+typedef void (*pool_callback)(struct pool *pool, long id, int status,
+			      void *client_data);
+
+extern  void  pool_config_init(struct pool_config *cfg);
+extern  struct pool *new_pool(const struct pool_config *cfg);
+extern  void  delete_pool(struct pool *pool);
+extern  void  pool_set_callback(struct pool *pool, pool_callback fn,
+				void *client_data);
+
+extern  void  pool_add_queue(struct pool *pool, const char *name,
+			     long max, long weight);
+extern  long  pool_submit(struct pool *pool, const char *cmd);
+extern  long  pool_submit_to(struct pool *pool, const char *queue,
+			     const char *cmd);
+extern  long  pool_submit_argv(struct pool *pool, char *const argv[]);
+extern  int  pool_cancel(struct pool *pool, long id);
+
+extern  void  pool_set_slots(struct pool *pool, long slots);
+extern  void  pool_hold(struct pool *pool, int hold);
+extern  void  pool_drain(struct pool *pool);
+extern  void  pool_dump(const struct pool *pool);
+extern  int  pool_control(struct pool *pool, const char *cmd);
+
+extern  int  pool_fd(const struct pool *pool);
+extern  long  pool_run(struct pool *pool, double timeout);
+extern  int  pool_wait(struct pool *pool);
+extern  void  pool_stats(const struct pool *pool, struct pool_stats *st);
+
+#endif /* FILE_LIBPARALLEL_H_SEEN */
@@ -24,26 +24,238 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/wait.h>
-#include <sys/time.h>
-#include <sys/resource.h>
-#include <assert.h>
 #include <errno.h>
+#include <sys/wait.h>
 
 #include "parallel.h"
 
 
+/* The command files.  Each file feeds the default queue, or the queue
+ * given with --queue; annotations override this.  */
+struct source {
+  char *fname;			/* NULL for stdin */
+  char *queue;			/* NULL for the default queue */
+  struct cf *cf;		/* NULL once all commands were read */
+};
+
+static struct source *sources;
+static int  n_sources, next_source;
+static int  source_failed;	/* a command file could not be read */
+
+static void
+add_source(const char *fname, const char *queue)
+{
+  struct source *src;
+
+  sources = xrenew(struct source, sources, n_sources+1);
+  src = sources + n_sources++;
+  src->fname = fname ? xstrdup(fname) : NULL;
+  src->queue = queue ? xstrdup(queue) : NULL;
+  src->cf = NULL;
+}
+
+static struct job *
+next_command(struct pool *pool, int *eof_p, void *client_data)
+/* The job source of the pool: read the next command from the command
+ * files, taking turns between the files whose queues need more
+ * jobs.  */
+{
+  int  i, k, active = 0;
+
+  for (i=0; i<n_sources; ++i) {
+    struct source *src;
+    struct job *job;
+
+    k = (next_source + i) % n_sources;
+    src = sources + k;
+    if (! src->cf)
+      continue;
+    ++active;
+    if (! pool_wants_more(pool, src->queue))
+      continue;
+    job = cf_next_job(src->cf);
+    if (! job) {
+      if (cf_is_incomplete(src->cf))
+	error("error: incomplete line at the end of command file (ignored)");
+      if (cf_has_error(src->cf))
+	source_failed = 1;
+      delete_cf(src->cf);
+      src->cf = NULL;
+      --active;
+      continue;
+    }
+    if (! job->queue_name && src->queue)
+      job->queue_name = xstrdup(src->queue);
+    next_source = (k + 1) % n_sources;
+    return job;
+  }
+  *eof_p = (active == 0);
+  return NULL;
+}
+
+static int
+parse_shard(const char *arg, long *k_p, long *n_p, int *by_hash_p)
+/* Parse a shard specification of the form "K/N[,hash]" or
+ * "K/N[,line]".  Return 0 on success and -1 on error.  */
+{
+  char *tail;
+
+  errno = 0;
+  *k_p = strtol(arg, &tail, 10);
+  if (tail == arg || *tail != '/' || errno)
+    return -1;
+  arg = tail+1;
+  *n_p = strtol(arg, &tail, 10);
+  if (tail == arg || errno || *k_p < 1 || *k_p > *n_p)
+    return -1;
+  if (*tail == '\0' || strcmp(tail, ",line") == 0) {
+    *by_hash_p = 0;
+  } else if (strcmp(tail, ",hash") == 0) {
+    *by_hash_p = 1;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+struct queue_def {
+  char *name;
+  long  max, weight;
+};
+
+static struct queue_def *queues;
+static int  n_queues;
+
+static void
+add_queues(struct pool *pool, void *client_data)
+{
+  int  i;
+
+  for (i=0; i<n_queues; ++i)
+    pool_add_queue(pool, queues[i].name, queues[i].max, queues[i].weight);
+}
+
+static int
+parse_queue(const char *arg, struct queue_def *def, char **fname_p)
+/* Parse a queue definition of the form
+ * "NAME[,max=N][,weight=W][,commands=FNAME]".  Return 0 on success and
+ * -1 on error.  */
+{
+  size_t  len = strcspn(arg, ",");
+
+  if (len == 0)
+    return -1;
+  def->name = xnew(char, len+1);
+  memcpy(def->name, arg, len);
+  def->name[len] = '\0';
+  def->max = 0;
+  def->weight = 1;
+  *fname_p = NULL;
+
+  for (arg += len; *arg == ','; arg += len) {
+    long  *val_p = NULL;
+    char *tail;
+
+    ++arg;
+    if (strncmp(arg, "commands=", 9) == 0) {
+      /* the file name extends to the end of the argument */
+      if (! arg[9])
+	goto fail;
+      xfree(*fname_p);
+      *fname_p = xstrdup(arg+9);
+      return 0;
+    }
+    len = strcspn(arg, ",");
+    if (strncmp(arg, "max=", 4) == 0) {
+      val_p = &def->max;
+      arg += 4;
+      len -= 4;
+    } else if (strncmp(arg, "weight=", 7) == 0) {
+      val_p = &def->weight;
+      arg += 7;
+      len -= 7;
+    } else {
+      goto fail;
+    }
+    errno = 0;
+    *val_p = strtol(arg, &tail, 10);
+    if (tail != arg+len || errno || tail == arg || *val_p < 1)
+      goto fail;
+  }
+  if (*arg)
+    goto fail;
+  return 0;
+
+ fail:
+  xfree(def->name);
+  xfree(*fname_p);
+  return -1;
+}
+
+
 /**********************************************************************
  * main program
  */
 
+enum {
+  opt_CACHE_SIZE = 1,
+  opt_HALT,
+  opt_JOBSERVER,
+  opt_SUSPEND,
+  opt_SHARD,
+  opt_INDEX,
+  opt_SIMULATE,
+  opt_COUNTERS,
+  opt_PIPE,
+  opt_BLOCK,
+  opt_SPECULATE,
+  opt_CONTROL,
+  opt_SPAWNERS,
+  opt_NICE,
+  opt_SCHED,
+  opt_IONICE,
+  opt_ARCHIVE,
+  opt_ARCHIVE_COMPRESS,
+  opt_EXTRACT,
+  opt_HEARTBEAT
+};
+
 int
 main(int argc, char **argv)
 {
   int  error_flag = 0;
   int  help_flag = 0;
   long  n_max = 0;
-  char *cf_name = NULL;
+  unsigned long long  mem_max = 0;
+  long  lookahead = 100;
+  char *cache_dir = NULL;
+  char *results_dir = NULL;
+  const char *archive = NULL;
+  int  archive_compress_flag = 0;
+  long  extract = 0;
+  unsigned long long  cache_size = 1ULL << 30;
+  const char *halt = NULL;
+  const char *js_style = NULL;
+  const char *suspend = NULL;
+  const char *control = NULL;
+  long  shard_k = 0, shard_n = 0;
+  int  shard_by_hash = 0;
+  int  index_flag = 0;
+  int  simulate_flag = 0;
+  int  counters_flag = 0;
+  const char *pipe_cmd = NULL;
+  unsigned long long  block_size = 1024*1024;
+  int  keep_order_flag = 0;
+  struct splitter *splitter = NULL;
+  double  speculate = 0;
+  long  spawners = 0;
+  int  nice_flag = 0, nice_level = 0;
+  const char *sched_policy = NULL;
+  const char *ionice = NULL;
+  const char *heartbeat = NULL;
+  struct heartbeat_policy  heartbeat_policy;
+  double  start;
   int  verbose_flag = 0;
   int  version_flag = 0;
   const char *optarg;
@@ -54,6 +266,58 @@ main(int argc, char **argv)
       "maxmimal number of parallel processes" },
     { "commands", 'c', NULL, 1, "FNAME",
       "read commands from FNAME instead of from stdin" },
+    { "pipe", opt_PIPE, NULL, 1, "COMMAND",
+      "run COMMAND once for every block of stdin" },
+    { "block", opt_BLOCK, NULL, 1, "SIZE",
+      "size of the blocks for --pipe (default: 1M)" },
+    { "keep-order", 'k', &keep_order_flag, 0, NULL,
+      "with --pipe, write the output in the order of the input" },
+    { "queue", 'q', NULL, 1, "NAME,...",
+      "set up a queue, e.g. \"io,max=4,weight=2\"" },
+    { "memory", 'm', NULL, 1, "SIZE",
+      "memory available to the jobs (default: all)" },
+    { "lookahead", 'l', NULL, 1, "N",
+      "number of pending jobs considered for packing" },
+    { "shard", opt_SHARD, NULL, 1, "K/N",
+      "run only part K of N of the commands" },
+    { "index", opt_INDEX, &index_flag, 0, NULL,
+      "keep the line index for --shard in FNAME.idx" },
+    { "cache", 'C', NULL, 1, "DIR",
+      "reuse results of earlier runs, stored in DIR" },
+    { "cache-size", opt_CACHE_SIZE, NULL, 1, "SIZE",
+      "maximal size of the result cache (default: 1G)" },
+    { "results", 'r', NULL, 1, "DIR",
+      "store the output of command N in DIR/N/" },
+    { "archive", opt_ARCHIVE, NULL, 1, "FILE",
+      "append the output of all commands to FILE" },
+    { "archive-compress", opt_ARCHIVE_COMPRESS, &archive_compress_flag, 0,
+      NULL, "compress the records of the archive" },
+    { "extract", opt_EXTRACT, NULL, 1, "N",
+      "show the output of command N from the archive" },
+    { "halt", opt_HALT, NULL, 1, "POLICY",
+      "stop after failures, e.g. \"now,fail=10%\"" },
+    { "jobserver", opt_JOBSERVER, NULL, 1, "STYLE",
+      "share slots with sub-makes (STYLE: pipe or fifo)" },
+    { "suspend", opt_SUSPEND, NULL, 1, "POLICY",
+      "stop jobs while busy, e.g. \"load=8\" or \"pressure=20\"" },
+    { "counters", opt_COUNTERS, &counters_flag, 0, NULL,
+      "measure the jobs with performance counters" },
+    { "control", opt_CONTROL, NULL, 1, "FIFO",
+      "read commands like \"slots 4\" or \"drain\" from FIFO" },
+    { "spawners", opt_SPAWNERS, NULL, 1, "N",
+      "use N threads to start jobs, for very many slots" },
+    { "nice", opt_NICE, NULL, 1, "N",
+      "nice level of the jobs (default: 19)" },
+    { "sched", opt_SCHED, NULL, 1, "POLICY",
+      "scheduling policy of the jobs: other, batch or idle" },
+    { "ionice", opt_IONICE, NULL, 1, "CLASS",
+      "I/O priority of the jobs, e.g. \"idle\" or \"be:7\"" },
+    { "heartbeat", opt_HEARTBEAT, NULL, 1, "POLICY",
+      "kill silent jobs, e.g. \"60\" or \"60,retry=2\"" },
+    { "simulate", opt_SIMULATE, &simulate_flag, 0, NULL,
+      "compare scheduling policies using the time annotations" },
+    { "speculate", opt_SPECULATE, NULL, 1, "FACTOR",
+      "at the end, run slow jobs twice and keep the faster copy" },
     { "verbose", 'v', &verbose_flag, 0, NULL,
       "emit messages to stdout" },
     { "version", 'V', &version_flag, 0, NULL,
@@ -61,8 +325,10 @@ main(int argc, char **argv)
     { NULL, '\0', NULL, 0, NULL, NULL }
   };
 
-  struct cf *cf;
-  long  n_running, cmd_no;
+  struct pool_config  cfg;
+  struct pool_stats  st;
+  struct pool *pool;
+  int  exit_status, i;
 
   open_options(argc, argv);
   do {
@@ -82,7 +348,134 @@ main(int argc, char **argv)
       }
       break;
     case 'c':
-      cf_name = xstrdup(optarg);
+      add_source(optarg, NULL);
+      break;
+    case 'q':
+      {
+	char *fname;
+	queues = xrenew(struct queue_def, queues, n_queues+1);
+	if (parse_queue(optarg, queues+n_queues, &fname) < 0) {
+	  error("error: invalid queue \"%s\"", optarg);
+	  error_flag = 1;
+	  break;
+	}
+	if (fname)
+	  add_source(fname, queues[n_queues].name);
+	xfree(fname);
+	++n_queues;
+      }
+      break;
+    case 'm':
+      if (parse_size(optarg, &mem_max) < 0 || mem_max == 0) {
+	error("error: invalid memory size \"%s\"", optarg);
+	error_flag = 1;
+      }
+      break;
+    case 'l':
+      {
+	char *tail;
+	errno = 0;
+	lookahead = strtol(optarg, &tail, 0);
+	if (tail==optarg || *tail!=0 || errno || lookahead<1) {
+	  error("error: invalid look-ahead \"%s\"", optarg);
+	  error_flag = 1;
+	}
+      }
+      break;
+    case 'C':
+      cache_dir = xstrdup(optarg);
+      break;
+    case opt_CACHE_SIZE:
+      if (parse_size(optarg, &cache_size) < 0 || cache_size == 0) {
+	error("error: invalid cache size \"%s\"", optarg);
+	error_flag = 1;
+      }
+      break;
+    case 'r':
+      results_dir = xstrdup(optarg);
+      break;
+    case opt_HALT:
+      halt = optarg;
+      break;
+    case opt_JOBSERVER:
+      js_style = optarg;
+      break;
+    case opt_SUSPEND:
+      suspend = optarg;
+      break;
+    case opt_CONTROL:
+      control = optarg;
+      break;
+    case opt_PIPE:
+      pipe_cmd = optarg;
+      break;
+    case opt_BLOCK:
+      if (parse_size(optarg, &block_size) < 0 || block_size == 0) {
+	error("error: invalid block size \"%s\"", optarg);
+	error_flag = 1;
+      }
+      break;
+    case opt_SPECULATE:
+      {
+	char *tail;
+	errno = 0;
+	speculate = strtod(optarg, &tail);
+	if (tail==optarg || *tail!=0 || errno || speculate<=1) {
+	  error("error: invalid speculation factor \"%s\"", optarg);
+	  error_flag = 1;
+	}
+      }
+      break;
+    case opt_SPAWNERS:
+      {
+	char *tail;
+	errno = 0;
+	spawners = strtol(optarg, &tail, 0);
+	if (tail==optarg || *tail!=0 || errno || spawners<1) {
+	  error("error: invalid number of spawner threads \"%s\"", optarg);
+	  error_flag = 1;
+	}
+      }
+      break;
+    case opt_ARCHIVE:
+      archive = optarg;
+      break;
+    case opt_EXTRACT:
+      {
+	char *tail;
+	errno = 0;
+	extract = strtol(optarg, &tail, 0);
+	if (tail==optarg || *tail!=0 || errno || extract<1) {
+	  error("error: invalid command number \"%s\"", optarg);
+	  error_flag = 1;
+	}
+      }
+      break;
+    case opt_NICE:
+      if (parse_nice(optarg, &nice_level) < 0) {
+	error("error: invalid nice level \"%s\"", optarg);
+	error_flag = 1;
+      }
+      nice_flag = 1;
+      break;
+    case opt_SCHED:
+      sched_policy = optarg;
+      break;
+    case opt_IONICE:
+      ionice = optarg;
+      break;
+    case opt_HEARTBEAT:
+      if (parse_heartbeat_policy(optarg, &heartbeat_policy) < 0) {
+	error("error: invalid heartbeat policy \"%s\"", optarg);
+	error_flag = 1;
+      }
+      heartbeat = optarg;
+      break;
+    case opt_SHARD:
+      if (parse_shard(optarg, &shard_k, &shard_n, &shard_by_hash) < 0) {
+	error("error: invalid shard \"%s\"", optarg);
+	error_flag = 1;
+      }
       break;
     case '\0':
       if (optarg)
@@ -97,6 +490,27 @@ main(int argc, char **argv)
   options_args(&argc, &argv);
   if (argc > 1)
     error("error: extra command line arguments");
+  if (pipe_cmd && (n_sources > 0 || shard_n > 0 || cache_dir
+		   || simulate_flag || speculate > 0)) {
+    /* a second copy of a job could not read its block again */
+    error("error: --pipe cannot be used with command files, --shard,"
+	  " --cache, --simulate or --speculate");
+    error_flag = 1;
+  }
+  if (keep_order_flag && (! pipe_cmd || results_dir || archive)) {
+    error("error: --keep-order needs --pipe and cannot be used with"
+	  " --results or --archive");
+    error_flag = 1;
+  }
+  /* the input block of a job is gone once the job has started */
+  if (pipe_cmd && heartbeat && heartbeat_policy.retries > 0) {
+    error("error: --pipe cannot be used with heartbeat retries");
+    error_flag = 1;
+  }
+  if (extract && ! archive) {
+    error("error: --extract needs --archive");
+    error_flag = 1;
+  }
 
   if (version_flag) {
     puts("parallel " VERSION);
@@ -119,76 +533,145 @@ the file named COPYING.");
   }
   close_options();
 
+  if (extract) {
+    int  status;
+    if (archive_extract(archive, extract, 1, 2, &status) < 0)
+      exit(1);
+    if (WIFEXITED(status))
+      exit(WEXITSTATUS(status));
+    if (WIFSIGNALED(status))
+      exit(128 + WTERMSIG(status));
+    exit(1);
+  }
+
   if (n_max == 0) {
     n_max = sysconf(_SC_NPROCESSORS_CONF);
   }
   if (verbose_flag)
     message("running up to %ld processes in parallel", n_max);
 
-  if (! cf_name)
+  pool_config_init(&cfg);
+  cfg.slots = n_max;
+  cfg.memory = mem_max;
+  cfg.lookahead = lookahead;
+  cfg.cache_dir = cache_dir;
+  cfg.cache_size = cache_size;
+  cfg.results_dir = results_dir;
+  cfg.archive = archive;
+  cfg.archive_compress = archive_compress_flag;
+  cfg.halt = halt;
+  cfg.jobserver = js_style;
+  cfg.suspend = suspend;
+  cfg.control = control;
+  cfg.verbosity = verbose_flag ? 2 : 1;
+  cfg.handle_signals = 1;
+  cfg.own_children = 1;
+  cfg.counters = counters_flag;
+  cfg.speculate = speculate;
+  cfg.spawners = spawners;
+  if (nice_flag)
+    cfg.nice = nice_level;
+  cfg.sched = sched_policy;
+  cfg.ionice = ionice;
+  cfg.heartbeat = heartbeat;
+  if (pipe_cmd) {
+    splitter = new_splitter(0, pipe_cmd, block_size, n_max, keep_order_flag);
+  } else if (n_sources == 0) {
     message("reading commands from stdin");
-  cf = new_cf(cf_name);
-  if (! cf)
-    fatal("error: cannot open command file \"%s\"", cf_name);
-
-  cmd_no = 0;
-  n_running = 0;
-  for (;;) {
-    const char *cmd;
-    pid_t pid;
-
-    while ((n_running < n_max) && (cmd = cf_next(cf))) {
-      ++cmd_no;
-
-      pid = fork();
-      if (pid == -1) {
-	error("error: fork failed (%m)");
-      } else if (pid == 0) {
-	/* child process */
-
-	setpriority(PRIO_PROCESS, 0, PRIO_MAX);
-
-	execl("/bin/sh", "sh", "-c", cmd, NULL);
-	/* only returns in case of error */
-	fprintf(stderr, "error: failed to execute child process (%m)\n");
-	_exit(1);
-      } else {
-	/* parent process */
-	++n_running;
-	message("%ld: %s (pid %d)", cmd_no, cmd, pid);
-      }
-    }
-    if (n_running == 0)
-      break;
+    add_source(NULL, NULL);
+  }
+  for (i=0; i<n_sources; ++i) {
+    struct source *src = sources+i;
+    src->cf = new_cf(src->fname);
+    if (! src->cf)
+      fatal("error: cannot open command file \"%s\"", src->fname);
+    if (shard_n > 0 && cf_set_shard(src->cf, src->fname, shard_k, shard_n,
+				    shard_by_hash, index_flag) < 0)
+      exit(1);
+  }
+  if (shard_n > 0 && verbose_flag)
+    message("running shard %ld of %ld", shard_k, shard_n);
 
-    {
-      int status;
+  if (simulate_flag) {
+    struct job **jobs = NULL;
+    long  n_jobs = 0, allocated = 0;
 
-      pid = wait(&status);
-      if (WIFEXITED(status)) {
-	int rc = WEXITSTATUS(status);
-	if (rc) {
-	  message("pid %d exited with status %d", pid, rc);
-	} else if (verbose_flag) {
-	  message("pid %d completed", pid);
+    for (i=0; i<n_sources; ++i) {
+      struct job *job;
+      while ((job = cf_next_job(sources[i].cf))) {
+	if (n_jobs == allocated) {
+	  allocated = allocated ? 2*allocated : 1024;
+	  jobs = xrenew(struct job *, jobs, allocated);
 	}
-      } else if (WIFSIGNALED(status)) {
-	message("pid %d terminated by signal %d", pid, WTERMSIG(status));
-      } else {
-	message("pid %d miraculously died", pid);
+	if (! job->queue_name && sources[i].queue)
+	  job->queue_name = xstrdup(sources[i].queue);
+	jobs[n_jobs++] = job;
       }
-      --n_running;
+      if (cf_has_error(sources[i].cf))
+	source_failed = 1;
     }
+    exit_status = simulate(jobs, n_jobs, &cfg, add_queues, NULL) < 0;
+    if (source_failed)
+      exit_status = 2;
+    while (n_jobs > 0)
+      delete_job(jobs[--n_jobs]);
+    xfree(jobs);
+    exit(exit_status);
   }
 
-  if (verbose_flag)
-    message("%ld jobs completed", cmd_no);
+  pool = new_pool(&cfg);
+  if (! pool)
+    exit(1);
+  add_queues(pool, NULL);
 
-  if (cf_is_incomplete(cf)) {
-    error("error: incomplete line at the end of command file (ignored)");
+  if (splitter)
+    splitter_attach(splitter, pool);
+  else
+    pool_set_source(pool, next_command, NULL);
+  start = current_time();
+  if (pool_wait(pool) < 0) {
+    error("error: cannot collect the finished commands (%m)");
+    delete_pool(pool);
+    exit(1);
   }
+  pool_stats(pool, &st);
 
-  delete_cf(cf);
-  xfree(cf_name);
-  return 0;
+  if (verbose_flag) {
+    double  elapsed = current_time() - start;
+    message("%ld jobs completed in %.2f seconds (%.0f jobs/s)", st.done,
+	    elapsed, elapsed > 0 ? st.done / elapsed : 0);
+  }
+  if (st.backups > 0)
+    message("%ld jobs were run twice, %ld second copies finished first,"
+	    " %.1f seconds saved", st.backups, st.backups_won, st.saved);
+  if (st.stalled > 0)
+    message("silent jobs were terminated %ld times and started again"
+	    " %ld times", st.stalled, st.requeued);
+
+  if (st.signal) {
+    exit_status = 128 + st.signal;
+  } else if (st.halted || source_failed) {
+    exit_status = 2;
+  } else if (st.failed) {
+    exit_status = 1;
+  } else {
+    exit_status = 0;
+  }
+
+  delete_pool(pool);
+  if (splitter)
+    delete_splitter(splitter);
+  for (i=0; i<n_sources; ++i) {
+    if (sources[i].cf)
+      delete_cf(sources[i].cf);
+    xfree(sources[i].fname);
+    xfree(sources[i].queue);
+  }
+  xfree(sources);
+  for (i=0; i<n_queues; ++i)
+    xfree(queues[i].name);
+  xfree(queues);
+  xfree(results_dir);
+  xfree(cache_dir);
+  return exit_status;
 }
@@ -17,8 +17,11 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <assert.h>
 
 #include "parallel.h"
@@ -83,6 +86,7 @@ check_short_opt(const struct voption *options, const char *str)
 
   for (j=0; options[j].name != NULL; ++j) {
     if (str[0] == options[j].short_name
+	&& isprint((unsigned char)str[0])
 	&& (str[1] == '\0' || options[j].has_arg)) {
       return  j;
     }
@@ -265,14 +269,69 @@ options_show(const struct voption *options)
 
   fputs("The following options are available:\n", stderr);
   for (i=0; options[i].name != NULL; ++i) {
+    char  buffer [80];
+    char  short_opt [5];
+
+    /* options without a short form use a non-printable character as
+     * 'short_name' */
+    if (isprint((unsigned char)options[i].short_name))
+      sprintf(short_opt, "-%c,", options[i].short_name);
+    else
+      strcpy(short_opt, "   ");
     if (options[i].has_arg) {
-      char  buffer [80];
       sprintf(buffer, "%s=%s", options[i].name, options[i].arg_name);
-      fprintf(stderr, "  -%c, --%-16s %s\n",
-	      options[i].short_name, buffer, options[i].help);
     } else {
-      fprintf(stderr, "  -%c, --%-16s %s\n",
-	      options[i].short_name, options[i].name, options[i].help);
+      sprintf(buffer, "%s", options[i].name);
     }
+    fprintf(stderr, "  %s --%-16s %s\n", short_opt, buffer, options[i].help);
   }
 }
+
+int
+parse_size(const char *str, unsigned long long *res)
+/* Convert STR, a number optionally followed by one of the suffixes
+ * "k", "M", "G" or "T", into a number of bytes.  Return 0 on success
+ * and -1 if STR cannot be parsed.  */
+{
+  unsigned long long  val;
+  char *tail;
+  int  shift = 0;
+
+  if (*str == '-')  return  -1;
+  errno = 0;
+  val = strtoull(str, &tail, 0);
+  if (tail == str || errno)  return  -1;
+  switch (*tail) {
+  case 'k': case 'K': shift = 10; ++tail; break;
+  case 'M': shift = 20; ++tail; break;
+  case 'G': shift = 30; ++tail; break;
+  case 'T': shift = 40; ++tail; break;
+  }
+  if (*tail == 'B')  ++tail;
+  if (*tail != '\0')  return  -1;
+  if (shift && val > (~0ULL >> shift))  return  -1;
+  *res = val << shift;
+  return  0;
+}
+
+int
+parse_duration(const char *str, double *res)
+/* Convert STR, a number optionally followed by one of the suffixes
+ * "s", "m" or "h", into a number of seconds.  Return 0 on success and
+ * -1 if STR cannot be parsed.  */
+{
+  double  val;
+  char *tail;
+
+  errno = 0;
+  val = strtod(str, &tail);
+  if (tail == str || errno || val < 0)  return  -1;
+  switch (*tail) {
+  case 's': ++tail; break;
+  case 'm': val *= 60; ++tail; break;
+  case 'h': val *= 3600; ++tail; break;
+  }
+  if (*tail != '\0')  return  -1;
+  *res = val;
+  return  0;
+}
@@ -19,6 +19,96 @@
 #ifndef FILE_PARALLEL_H_SEEN
 #define FILE_PARALLEL_H_SEEN
 
+#include <stdio.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "libparallel.h"
+
+/* The internal functions of libparallel.a get a prefix, so that they
+ * cannot clash with the functions of a program which embeds the
+ * library, e.g. with error(3) from the C library.  */
+#define  archive_extract  parallel_archive_extract
+#define  archive_finish  parallel_archive_finish
+#define  archive_prepare  parallel_archive_prepare
+#define  archive_tick  parallel_archive_tick
+#define  cache_discard  parallel_cache_discard
+#define  cache_lookup  parallel_cache_lookup
+#define  cache_prepare  parallel_cache_prepare
+#define  cache_store  parallel_cache_store
+#define  close_archive  parallel_close_archive
+#define  close_cache  parallel_close_cache
+#define  close_log  parallel_close_log
+#define  close_results  parallel_close_results
+#define  copy_fd  parallel_copy_fd
+#define  copy_job  parallel_copy_job
+#define  counter_name  parallel_counter_name
+#define  counters_attach  parallel_counters_attach
+#define  counters_collect  parallel_counters_collect
+#define  counters_init  parallel_counters_init
+#define  current_time  parallel_current_time
+#define  delete_job  parallel_delete_job
+#define  delete_jobserver  parallel_delete_jobserver
+#define  delete_sched  parallel_delete_sched
+#define  error  parallel_error
+#define  fatal  parallel_fatal
+#define  get_priority  parallel_get_priority
+#define  hash_final  parallel_hash_final
+#define  hash_init  parallel_hash_init
+#define  hash_update  parallel_hash_update
+#define  job_output_fd  parallel_job_output_fd
+#define  jobserver_acquire  parallel_jobserver_acquire
+#define  jobserver_fd  parallel_jobserver_fd
+#define  jobserver_from_env  parallel_jobserver_from_env
+#define  jobserver_held  parallel_jobserver_held
+#define  jobserver_release  parallel_jobserver_release
+#define  log_add_client  parallel_log_add_client
+#define  log_remove_client  parallel_log_remove_client
+#define  log_up_and_running  parallel_log_up_and_running
+#define  log_write_line  parallel_log_write_line
+#define  message  parallel_message
+#define  new_buffer_file  parallel_new_buffer_file
+#define  new_job  parallel_new_job
+#define  new_jobserver  parallel_new_jobserver
+#define  new_sched  parallel_new_sched
+#define  open_archive  parallel_open_archive
+#define  open_cache  parallel_open_cache
+#define  open_heartbeat  parallel_open_heartbeat
+#define  open_log  parallel_open_log
+#define  open_results  parallel_open_results
+#define  parse_heartbeat_policy  parallel_parse_heartbeat_policy
+#define  parse_ioprio  parallel_parse_ioprio
+#define  parse_nice  parallel_parse_nice
+#define  parse_pressure_policy  parallel_parse_pressure_policy
+#define  parse_sched_policy  parallel_parse_sched_policy
+#define  priority_init  parallel_priority_init
+#define  priority_merge  parallel_priority_merge
+#define  read_heartbeat  parallel_read_heartbeat
+#define  read_pressure  parallel_read_pressure
+#define  results_finish  parallel_results_finish
+#define  results_prepare  parallel_results_prepare
+#define  sched_add  parallel_sched_add
+#define  sched_add_queue  parallel_sched_add_queue
+#define  sched_cpus_used  parallel_sched_cpus_used
+#define  sched_demand  parallel_sched_demand
+#define  sched_next  parallel_sched_next
+#define  sched_pending  parallel_sched_pending
+#define  sched_release  parallel_sched_release
+#define  sched_remove  parallel_sched_remove
+#define  sched_set_cpus  parallel_sched_set_cpus
+#define  sched_set_limit  parallel_sched_set_limit
+#define  sched_set_order  parallel_sched_set_order
+#define  sched_wants_more  parallel_sched_wants_more
+#define  set_priority  parallel_set_priority
+#define  set_thread_priority  parallel_set_thread_priority
+#define  warning  parallel_warning
+#define  write_status  parallel_write_status
+#define  xfree  parallel_xfree
+#define  xmalloc  parallel_xmalloc
+#define  xrealloc  parallel_xrealloc
+#define  xstrdup  parallel_xstrdup
+
 #if __GNUC__ >= 3
 #define  jv_pure  __attribute__((pure))
 #define  jv_const  __attribute__((const))
@@ -103,6 +193,8 @@ extern  void  options_args(int *argc_p, char ***argv_p);
 extern  int  options_get(const struct voption *options,
 			 const char **argptr, int flags);
 extern  void  options_show(const struct voption *options);
+extern  int  parse_size(const char *str, unsigned long long *res);
+extern  int  parse_duration(const char *str, double *res);
 
 
 /* cf.c */
@@ -111,5 +203,265 @@ extern  struct cf *new_cf(const char *fname);
 extern  void  delete_cf(struct cf *cf);
 extern  const char *cf_next(struct cf *cf);
 extern  int  cf_is_incomplete(const struct cf *cf);
+extern  int  cf_has_error(const struct cf *cf);
+extern  int  cf_set_shard(struct cf *cf, const char *fname, long k, long n,
+			  int by_hash, int use_index);
+extern  struct job *cf_next_job(struct cf *cf);
+
+
+/* pipe.c */
+
+extern  struct splitter *new_splitter(int fd, const char *cmd,
+				      unsigned long long block_size,
+				      long slots, int keep_order);
+extern  void  delete_splitter(struct splitter *sp);
+extern  void  splitter_attach(struct splitter *sp, struct pool *pool);
+
+
+/* index.c */
+
+extern  struct cf_index *open_index(const char *fname, int use_sidecar);
+extern  void  close_index(struct cf_index *idx);
+extern  long  index_commands(const struct cf_index *idx);
+extern  off_t  index_seek(const struct cf_index *idx, long cmd,
+			  long *found_p);
+
+
+/* decompress.c */
+
+extern  const char *compression_format(const void *lead, size_t len);
+extern  struct dstream *new_dstream(int fd, const void *lead, size_t len);
+extern  void  delete_dstream(struct dstream *ds);
+extern  ssize_t  dstream_read(struct dstream *ds, void *buf, size_t len);
+
+
+/* priority.c */
+
+#define PRIORITY_UNSET INT_MIN
+
+struct priority {
+  int  nice;			/* nice level, or PRIORITY_UNSET */
+  int  policy;			/* e.g. SCHED_IDLE, or PRIORITY_UNSET */
+  int  ioprio;			/* I/O class and level, or PRIORITY_UNSET */
+};
+
+extern  void  priority_init(struct priority *prio);
+extern  int  parse_nice(const char *arg, int *nice_p);
+extern  int  parse_sched_policy(const char *arg, int *policy_p);
+extern  int  parse_ioprio(const char *arg, int *ioprio_p);
+extern  void  priority_merge(struct priority *res,
+			     const struct priority *prio,
+			     const struct priority *dflt);
+extern  void  get_priority(struct priority *prio);
+extern  int  set_thread_priority(const struct priority *prio);
+extern  int  set_priority(pid_t pgrp, const struct priority *prio);
+
+
+/* sched.c */
+
+#define MAX_COUNTERS 8
+
+struct job {
+  struct job *next;
+  struct job *prev;		/* previous job in the list of running jobs */
+  long  cmd_no;			/* position in the command file */
+  char *cmd;			/* the command, passed to /bin/sh */
+  char **argv;			/* run directly instead of CMD, or NULL */
+  char *queue_name;		/* queue for the job, or NULL for default */
+  int  queue;			/* index of the queue, set by 'sched_add' */
+  long  cpus;			/* number of cpus the command uses */
+  unsigned long long  mem;	/* bytes of memory the command uses */
+  double  duration;		/* expected run time in seconds, or 0 */
+  struct priority  prio;	/* scheduling hints, unset for the defaults */
+  long  passed;			/* how often other jobs overtook this one */
+  char **inputs;		/* input files, for the result cache */
+  int  n_inputs;
+  char *cache_key;		/* cache key, once computed */
+  char *cache_tmp;		/* directory for the new cache entry */
+  int  in_fd;			/* stdin for the child, or -1 */
+  int  out_fd, err_fd;		/* stdout/stderr for the child, or -1 */
+  int  result_out, result_err;	/* files in the result directory, or -1 */
+  int  spec_out, spec_err;	/* output captured for speculation, or -1 */
+  pid_t  pid;			/* process ID, once the job is running */
+  int  pidfd;			/* process file descriptor, or -1 */
+  double  start_time, end_time;	/* monotonic clock, in seconds */
+  double  start_wall;		/* start time, in seconds since the epoch */
+  int  paused;			/* stopped because the machine is busy */
+  double  pause_start;		/* when the job was stopped */
+  double  paused_time;		/* total time spent stopped */
+  double  kill_time;		/* when to send SIGKILL, or 0 */
+  double  last_beat;		/* time of the last heartbeat */
+  double  progress;		/* fraction done, as reported, or -1 */
+  int  stalled;			/* killed for missing heartbeats */
+  int  attempts;		/* earlier runs which stalled */
+  struct job *twin;		/* the other copy of a speculated job */
+  int  backup;			/* this is the second copy */
+  int  lost;			/* the other copy finished first */
+  int  counter_fd[MAX_COUNTERS];	/* performance counters, or -1 */
+  unsigned long long  counter[MAX_COUNTERS]; /* final counter values */
+  int  n_counters;
+  int  no_counters;		/* the counters could not be attached */
+};
+
+enum sched_order { order_FIFO, order_LPT };
+
+extern  struct job *new_job(long cmd_no, const char *cmd) jv_malloc;
+extern  struct job *copy_job(const struct job *job) jv_malloc;
+extern  void  delete_job(struct job *job);
+extern  int  job_output_fd(const struct job *job, int fd);
+
+extern  struct sched *new_sched(long cpus, unsigned long long mem,
+				long lookahead);
+extern  void  delete_sched(struct sched *s);
+extern  void  sched_add_queue(struct sched *s, const char *name, long max,
+			      long weight);
+extern  int  sched_wants_more(struct sched *s, const char *queue);
+extern  long  sched_pending(const struct sched *s);
+extern  long  sched_demand(const struct sched *s);
+extern  long  sched_cpus_used(const struct sched *s);
+extern  void  sched_set_limit(struct sched *s, long cpus);
+extern  void  sched_set_cpus(struct sched *s, long cpus);
+extern  void  sched_set_order(struct sched *s, enum sched_order order);
+extern  void  sched_add(struct sched *s, struct job *job);
+extern  struct job *sched_next(struct sched *s);
+extern  struct job *sched_remove(struct sched *s, long cmd_no);
+extern  void  sched_release(struct sched *s, const struct job *job);
+
+
+/* pool.c */
+
+/* A backend runs the jobs of a pool.  'start' sets 'job->pid' to an ID
+ * for the job and returns 0, or returns -1 on error.  'reap' returns
+ * the ID of a finished job, or 0 if no job of the RUNNING list has
+ * finished.  'wait' sleeps until a job may have finished or until FD
+ * becomes readable, for at most TIMEOUT seconds (if non-negative).  */
+struct backend {
+  int  (*start)(struct job *job, void *data);
+  void  (*signal)(const struct job *job, int signum, void *data);
+  pid_t  (*reap)(const struct job *running, int *status_p, void *data);
+  double  (*now)(void *data);
+  void  (*wait)(double timeout, int fd, void *data);
+};
+
+typedef  struct job *(*job_source_fn)(struct pool *pool, int *eof_p,
+				      void *client_data);
+
+extern  double  current_time(void);
+extern  void  pool_set_backend(struct pool *pool,
+			       const struct backend *backend,
+			       void *client_data);
+extern  double  pool_now(const struct pool *pool);
+extern  void  pool_set_source(struct pool *pool, job_source_fn fn,
+			      void *client_data);
+extern  void  pool_watch_source(struct pool *pool, int fd);
+extern  int  pool_wants_more(struct pool *pool, const char *queue);
+extern  void  pool_set_order(struct pool *pool, enum sched_order order);
+extern  void  pool_add_job(struct pool *pool, struct job *job);
+
+
+/* sim.c */
+
+extern  int  simulate(struct job *const *jobs, long n_jobs,
+		      const struct pool_config *cfg,
+		      void (*setup)(struct pool *pool, void *data),
+		      void *setup_data);
+
+
+/* results.c */
+
+extern  struct results *open_results(const char *dir);
+extern  void  close_results(struct results *r);
+extern  int  results_prepare(struct results *r, struct job *job);
+extern  void  results_finish(struct results *r, struct job *job,
+			     int status, int cached);
+extern  void  write_status(FILE *f, const struct job *job, int status,
+			   int cached);
+
+
+/* jobserver.c */
+
+extern  struct jobserver *jobserver_from_env(void);
+extern  struct jobserver *new_jobserver(long slots, int use_fifo);
+extern  void  delete_jobserver(struct jobserver *js);
+extern  int  jobserver_acquire(struct jobserver *js);
+extern  void  jobserver_release(struct jobserver *js);
+extern  long  jobserver_held(const struct jobserver *js);
+extern  int  jobserver_fd(const struct jobserver *js);
+
+
+/* pressure.c */
+
+enum pressure_kind { pressure_NONE, pressure_LOAD, pressure_CPU };
+
+struct pressure_policy {
+  enum pressure_kind  kind;
+  double  high;			/* suspend jobs above this value */
+  double  low;			/* resume jobs below this value */
+  double  window;		/* seconds the measurement lags behind */
+};
+
+extern  int  parse_pressure_policy(const char *arg,
+				   struct pressure_policy *policy);
+extern  int  read_pressure(const struct pressure_policy *policy,
+			   double *value_p);
+
+
+/* heartbeat.c */
+
+struct heartbeat_policy {
+  double  timeout;		/* kill jobs silent for this long, in seconds */
+  int  retries;			/* how often a silent job is started again */
+};
+
+extern  int  parse_heartbeat_policy(const char *arg,
+				    struct heartbeat_policy *policy);
+extern  int  open_heartbeat(int fd[2]);
+extern  int  read_heartbeat(int fd, pid_t *pid_p, double *progress_p);
+
+
+/* counters.c */
+
+extern  int  counters_init(void);
+extern  const char *counter_name(int i);
+extern  int  counters_attach(struct job *job);
+extern  void  counters_collect(struct job *job);
+
+
+/* hash.c */
+
+struct hash {
+  uint64_t  h1, h2;
+  uint64_t  len;
+  unsigned char  buf[16];
+};
+
+extern  void  hash_init(struct hash *h);
+extern  void  hash_update(struct hash *h, const void *data, size_t len);
+extern  void  hash_final(struct hash *h, char *hex);
+
+
+/* archive.c */
+
+extern  int  new_buffer_file(void);
+extern  struct archive *open_archive(const char *path, int compress);
+extern  void  close_archive(struct archive *ar);
+extern  int  archive_prepare(struct archive *ar, struct job *job);
+extern  void  archive_finish(struct archive *ar, struct job *job,
+			     int status, int cached, double now);
+extern  double  archive_tick(struct archive *ar, double now);
+extern  int  archive_extract(const char *path, long cmd_no, int out,
+			     int err, int *status_p);
+
+
+/* cache.c */
+
+extern  struct cache *open_cache(const char *dir,
+				 unsigned long long max_size);
+extern  void  close_cache(struct cache *c);
+extern  int  copy_fd(int in, int out);
+extern  int  cache_lookup(struct cache *c, struct job *job, int *status_p);
+extern  int  cache_prepare(struct cache *c, struct job *job);
+extern  void  cache_store(struct cache *c, struct job *job, int status);
+extern  void  cache_discard(struct job *job);
 
 #endif /* FILE_PARALLEL_H_SEEN */
@@ -0,0 +1,520 @@
+/* pipe.c - split stdin into blocks and feed them to the jobs
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every block is staged in an anonymous in-memory file, which becomes
+ * the standard input of one job.  The data is moved into the file with
+ * splice() (if the input is a pipe) or sendfile() (if it is a file), so
+ * that it does not pass through user space; only the incomplete line
+ * at the end of each block is read back and carried over to the next
+ * one.  Since the jobs read from files instead of pipes, a slow job
+ * never stalls the reader, and the number of blocks in memory is
+ * bounded by the size of the window.
+ *
+ * If threads are available, the blocks are filled by a reader thread,
+ * which stays up to READ_AHEAD blocks ahead, so that a slow producer
+ * does not stall the pool; the pool waits for the notification pipe
+ * of the reader like for any other event.
+ *
+ * If the output order is to be kept, the standard output of every job
+ * is also captured in an in-memory file and is copied to stdout once
+ * all earlier blocks are done.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "parallel.h"
+
+
+#define READ_AHEAD 2
+
+struct block_out {
+  int  fd;			/* captured output, or -1 */
+  int  done;
+};
+
+struct splitter {
+  int  in;
+  const char *cmd;
+  size_t  block_size;
+  long  window;			/* maximal number of blocks in memory */
+  int  keep_order;
+  int  no_splice, no_sendfile;
+
+  char *carry;			/* start of the next block */
+  size_t  carry_len, carry_allocated;
+  int  eof;
+  const char *err_msg;		/* why reading the input failed, or NULL */
+  int  err_errno;
+  int  input_done;		/* all blocks have been handed out */
+#ifdef HAVE_PTHREAD
+  int  started;
+  pthread_t  thread;
+  pthread_mutex_t  lock;
+  pthread_cond_t  cond;
+  int  ready[READ_AHEAD];	/* blocks read ahead, oldest first */
+  int  n_ready;
+  int  reader_done;		/* the reader has read its last block */
+  int  stop;
+  int  notify[2];		/* the reader writes a byte per block */
+#endif
+  int  stop_fd[2];		/* closed to interrupt the reader */
+
+  long  next_block;		/* number of the next block, from 1 */
+  long  in_flight;		/* blocks handed out but not yet done */
+  struct block_out *outs;	/* indexed by block number modulo WINDOW */
+  long  next_out;		/* next block to be written to stdout */
+};
+
+
+static int
+wait_for_input(struct splitter *sp)
+/* Wait until the input is readable.  Return -1 if the splitter is
+ * being deleted.  */
+{
+  struct pollfd  pfd[2];
+
+  if (sp->stop_fd[0] < 0)
+    return 0;
+  pfd[0].fd = sp->in;
+  pfd[0].events = POLLIN;
+  pfd[1].fd = sp->stop_fd[0];
+  pfd[1].events = POLLIN;
+  while (poll(pfd, 2, -1) < 0) {
+    if (errno != EINTR)
+      return -1;
+  }
+  if (pfd[1].revents) {
+    errno = ECANCELED;
+    return -1;
+  }
+  return 0;
+}
+
+static ssize_t
+move_data(struct splitter *sp, int out, size_t len)
+/* Append up to LEN bytes from the input to the file OUT.  Return the
+ * number of bytes moved, which is less than LEN only at the end of
+ * input, or -1 on error.  */
+{
+  char  buffer[65536];
+  size_t  done = 0;
+  ssize_t  n;
+
+  while (done < len) {
+    size_t  want = len - done;
+
+    /* only block in poll(), where the reader can be stopped */
+    if (wait_for_input(sp) < 0)
+      return -1;
+
+#ifdef HAVE_SPLICE
+    if (! sp->no_splice) {
+      n = splice(sp->in, NULL, out, NULL, want, SPLICE_F_MOVE);
+      if (n < 0 && errno == EINVAL) {
+	sp->no_splice = 1;
+	continue;
+      }
+      goto got;
+    }
+#endif
+    if (! sp->no_sendfile) {
+      n = sendfile(out, sp->in, NULL, want);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+	sp->no_sendfile = 1;
+	continue;
+      }
+      goto got;
+    }
+    n = read(sp->in, buffer, want < sizeof(buffer) ? want : sizeof(buffer));
+    if (n > 0 && write(out, buffer, n) != n)
+      return -1;
+
+  got:
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  return done;
+}
+
+static off_t
+last_line_end(int fd, off_t from, off_t size)
+/* Return the offset just after the last newline in the byte range
+ * FROM to SIZE of FD, or -1 if there is none.  */
+{
+  char  buffer[65536];
+  off_t  pos = size;
+
+  while (pos > from) {
+    size_t  len = pos - from < (off_t)sizeof(buffer)
+      ? pos - from : sizeof(buffer);
+    ssize_t  n = pread(fd, buffer, len, pos - len);
+    char *nl;
+    if (n != (ssize_t)len)
+      return -1;
+    nl = memrchr(buffer, '\n', len);
+    if (nl)
+      return pos - len + (nl - buffer) + 1;
+    pos -= len;
+  }
+  return -1;
+}
+
+static int
+read_block(struct splitter *sp)
+/* Read the next block from the input, ending after a complete line.
+ * Return a file descriptor for the block, positioned at the start, or
+ * -1 at the end of input or on error.  Errors are recorded in
+ * 'sp->err_msg', since this may run in the reader thread.  */
+{
+  off_t  size, searched, end;
+  ssize_t  n;
+  int  fd;
+
+  fd = new_buffer_file();
+  if (fd < 0) {
+    sp->err_msg = "cannot create buffer file";
+    sp->err_errno = errno;
+    sp->eof = 1;
+    return -1;
+  }
+  if (sp->carry_len > 0
+      && write(fd, sp->carry, sp->carry_len) != (ssize_t)sp->carry_len)
+    goto fail;
+  size = sp->carry_len;
+  searched = 0;
+  sp->carry_len = 0;
+
+  /* A block holds at least BLOCK_SIZE bytes, unless the input ends.
+   * Lines longer than a block are kept together.  */
+  end = -1;
+  while (! sp->eof) {
+    size_t  want = size < (off_t)sp->block_size
+      ? sp->block_size - size : sp->block_size;
+    n = move_data(sp, fd, want);
+    if (n < 0)
+      goto fail;
+    size += n;
+    if ((size_t)n < want)
+      sp->eof = 1;
+    if (size >= (off_t)sp->block_size) {
+      end = last_line_end(fd, searched, size);
+      if (end >= 0)
+	break;
+      searched = size;
+    }
+  }
+
+  if (end >= 0 && end < size) {
+    sp->carry_len = size - end;
+    if (sp->carry_len > sp->carry_allocated) {
+      sp->carry_allocated = sp->carry_len;
+      sp->carry = xrenew(char, sp->carry, sp->carry_allocated);
+    }
+    if (pread(fd, sp->carry, sp->carry_len, end) != (ssize_t)sp->carry_len
+	|| ftruncate(fd, end) < 0)
+      goto fail;
+  } else if (size == 0) {
+    close(fd);
+    return -1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  return fd;
+
+ fail:
+  if (errno != ECANCELED) {
+    sp->err_msg = "cannot read input";
+    sp->err_errno = errno;
+  }
+  close(fd);
+  sp->eof = 1;
+  sp->carry_len = 0;
+  return -1;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+reader_main(void *arg)
+/* The reader thread: keep up to READ_AHEAD blocks ready.  */
+{
+  struct splitter *sp = arg;
+  int  fd, stop;
+
+  for (;;) {
+    pthread_mutex_lock(&sp->lock);
+    while (sp->n_ready == READ_AHEAD && ! sp->stop)
+      pthread_cond_wait(&sp->cond, &sp->lock);
+    stop = sp->stop;
+    pthread_mutex_unlock(&sp->lock);
+    if (stop)
+      break;
+
+    fd = sp->eof && sp->carry_len == 0 ? -1 : read_block(sp);
+
+    pthread_mutex_lock(&sp->lock);
+    if (fd >= 0)
+      sp->ready[sp->n_ready++] = fd;
+    else
+      sp->reader_done = 1;
+    pthread_mutex_unlock(&sp->lock);
+    if (write(sp->notify[1], "", 1) < 0) {
+      /* the pipe is full, so the pool will look anyway */
+    }
+    if (fd < 0)
+      break;
+  }
+  return NULL;
+}
+#endif
+
+static int
+take_block(struct splitter *sp)
+/* Return the next block of input, or -1 if none is ready.  Set
+ * 'sp->input_done' once all blocks have been taken.  */
+{
+  int  fd = -1;
+
+#ifdef HAVE_PTHREAD
+  if (sp->started) {
+    pthread_mutex_lock(&sp->lock);
+    if (sp->n_ready > 0) {
+      fd = sp->ready[0];
+      memmove(sp->ready, sp->ready+1, --sp->n_ready * sizeof(int));
+      pthread_cond_broadcast(&sp->cond);
+    } else if (sp->reader_done) {
+      sp->input_done = 1;
+    }
+    pthread_mutex_unlock(&sp->lock);
+  } else
+#endif
+  {
+    if (! (sp->eof && sp->carry_len == 0))
+      fd = read_block(sp);
+    if (fd < 0 && sp->eof && sp->carry_len == 0)
+      sp->input_done = 1;
+  }
+
+  if (sp->input_done && sp->err_msg) {
+    errno = sp->err_errno;
+    error("error: %s (%m)", sp->err_msg);
+    sp->err_msg = NULL;
+  }
+  return fd;
+}
+
+static void
+flush_outputs(struct splitter *sp)
+/* Copy the output of all finished blocks to stdout, in order.  */
+{
+  struct block_out *out;
+
+  fflush(stdout);
+  for (;;) {
+    out = sp->outs + sp->next_out % sp->window;
+    if (sp->next_out >= sp->next_block || ! out->done)
+      break;
+    if (out->fd >= 0) {
+      lseek(out->fd, 0, SEEK_SET);
+      if (copy_fd(out->fd, 1) < 0)
+	error("error: cannot write output of block %ld (%m)", sp->next_out);
+      close(out->fd);
+      out->fd = -1;
+    }
+    out->done = 0;
+    ++sp->next_out;
+  }
+}
+
+static struct job *
+next_block(struct pool *pool, int *eof_p, void *client_data)
+/* The job source of the pool: one job for every block of input.  */
+{
+  struct splitter *sp = client_data;
+  struct block_out *out = NULL;
+  struct job *job;
+  int  fd;
+
+#ifdef HAVE_PTHREAD
+  if (sp->started) {
+    /* drain the notifications even when the window is full, or the
+     * pool would keep waking up; a finished job calls us again */
+    char  buffer[64];
+    while (read(sp->notify[0], buffer, sizeof(buffer)) > 0)
+      ;
+  }
+#endif
+  if (sp->input_done) {
+    *eof_p = 1;
+    return NULL;
+  }
+  if (sp->keep_order ? sp->next_block - sp->next_out >= sp->window
+      : sp->in_flight >= sp->window)
+    return NULL;
+  if (! pool_wants_more(pool, NULL))
+    return NULL;
+
+  fd = take_block(sp);
+  if (fd < 0) {
+    *eof_p = sp->input_done;
+    return NULL;
+  }
+  job = new_job(sp->next_block, sp->cmd);
+  job->in_fd = fd;
+  if (sp->keep_order) {
+    out = sp->outs + sp->next_block % sp->window;
+    out->fd = new_buffer_file();
+    if (out->fd < 0)
+      error("error: cannot capture output of block %ld (%m)",
+	    sp->next_block);
+    else
+      job->out_fd = fcntl(out->fd, F_DUPFD_CLOEXEC, 0);
+  }
+  ++sp->next_block;
+  ++sp->in_flight;
+  return job;
+}
+
+static void
+block_done(struct pool *pool, long id, int status, void *client_data)
+{
+  struct splitter *sp = client_data;
+
+  --sp->in_flight;
+  if (sp->keep_order) {
+    sp->outs[id % sp->window].done = 1;
+    flush_outputs(sp);
+  }
+}
+
+
+/**********************************************************************
+ * global functions
+ */
+
+struct splitter *
+new_splitter(int fd, const char *cmd, unsigned long long block_size,
+	     long slots, int keep_order)
+/* Prepare to run CMD once for every block of about BLOCK_SIZE bytes
+ * read from FD.  Blocks end at line boundaries.  If KEEP_ORDER is set,
+ * the outputs are written in the order of the blocks.  */
+{
+  struct splitter *sp;
+  long  i;
+
+  sp = xnew(struct splitter, 1);
+  memset(sp, 0, sizeof(struct splitter));
+  sp->in = fd;
+  sp->cmd = cmd;
+  sp->block_size = block_size;
+  sp->keep_order = keep_order;
+  /* with ordered output, a slow block must not stop all other jobs */
+  sp->window = keep_order ? 2 * slots : slots + 1;
+  sp->next_block = sp->next_out = 1;
+  sp->stop_fd[0] = sp->stop_fd[1] = -1;
+  if (keep_order) {
+    sp->outs = xnew(struct block_out, sp->window);
+    for (i=0; i<sp->window; ++i) {
+      sp->outs[i].fd = -1;
+      sp->outs[i].done = 0;
+    }
+  }
+  return sp;
+}
+
+void
+delete_splitter(struct splitter *sp)
+{
+  long  i;
+
+#ifdef HAVE_PTHREAD
+  if (sp->started) {
+    pthread_mutex_lock(&sp->lock);
+    sp->stop = 1;
+    pthread_cond_broadcast(&sp->cond);
+    pthread_mutex_unlock(&sp->lock);
+    close(sp->stop_fd[1]);
+    pthread_join(sp->thread, NULL);
+    while (sp->n_ready > 0)
+      close(sp->ready[--sp->n_ready]);
+    close(sp->stop_fd[0]);
+    close(sp->notify[0]);
+    close(sp->notify[1]);
+    pthread_cond_destroy(&sp->cond);
+    pthread_mutex_destroy(&sp->lock);
+  }
+#endif
+
+  if (sp->outs) {
+    for (i=0; i<sp->window; ++i) {
+      if (sp->outs[i].fd >= 0)
+	close(sp->outs[i].fd);
+    }
+    xfree(sp->outs);
+  }
+  xfree(sp->carry);
+  xfree(sp);
+}
+
+void
+splitter_attach(struct splitter *sp, struct pool *pool)
+/* Make SP the job source of POOL, and start reading the input.  */
+{
+  pool_set_source(pool, next_block, sp);
+  pool_set_callback(pool, block_done, sp);
+#ifdef HAVE_PTHREAD
+  if (pipe2(sp->notify, O_CLOEXEC|O_NONBLOCK) < 0)
+    return;
+  if (pipe2(sp->stop_fd, O_CLOEXEC) < 0) {
+    close(sp->notify[0]);
+    close(sp->notify[1]);
+    return;
+  }
+  pthread_mutex_init(&sp->lock, NULL);
+  pthread_cond_init(&sp->cond, NULL);
+  if (pthread_create(&sp->thread, NULL, reader_main, sp) != 0) {
+    /* read the blocks synchronously instead */
+    pthread_cond_destroy(&sp->cond);
+    pthread_mutex_destroy(&sp->lock);
+    close(sp->notify[0]);
+    close(sp->notify[1]);
+    close(sp->stop_fd[0]);
+    close(sp->stop_fd[1]);
+    sp->stop_fd[0] = sp->stop_fd[1] = -1;
+    return;
+  }
+  sp->started = 1;
+  pool_watch_source(pool, sp->notify[0]);
+#endif
+}
@@ -0,0 +1,2409 @@
+/* pool.c - start, watch and reap the jobs
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#include "parallel.h"
+
+
+/* After sending SIGTERM to a job, wait this many seconds before using
+ * SIGKILL.  */
+#define KILL_DELAY 5.0
+
+/* While the machine is busy, check the load this often (in seconds)
+ * and suspend or resume at most one job each time.  After each change,
+ * the next one waits for the averaging window of the measurement, so
+ * that the effect of the change can show.  */
+#define PRESSURE_INTERVAL 2.0
+
+/* A failure percentage is only acted upon once this many jobs have
+ * finished.  */
+#define HALT_MIN_JOBS 10
+
+/* Speculation compares against the median run time of the last
+ * SPECULATE_SAMPLES jobs, once SPECULATE_MIN_JOBS jobs have finished,
+ * and looks for slow jobs every SPECULATE_INTERVAL seconds.  */
+#define SPECULATE_SAMPLES 1024
+#define SPECULATE_MIN_JOBS 3
+#define SPECULATE_INTERVAL 1.0
+
+/* With spawner threads, jobs are started in batches of up to this
+ * many.  */
+#define SPAWN_BATCH 256
+#define MAX_SPAWNERS 64
+
+/* Unless the pool owns all children, every job is watched through a
+ * process file descriptor, so that finding a finished job does not
+ * depend on the number of running jobs.  */
+#if defined(HAVE_SYS_EPOLL_H) && defined(SYS_pidfd_open)
+#define USE_PIDFD 1
+#endif
+
+/* Read at most this many heartbeats per round, so that chatty jobs
+ * cannot starve the pool.  */
+#define HEARTBEAT_MESSAGES 1024
+
+enum halt_mode { halt_NEVER, halt_SOON, halt_NOW };
+
+struct halt_policy {
+  enum halt_mode  mode;
+  long  fail_count;		/* halt after this many failures, or 0 */
+  double  fail_percent;		/* halt at this failure rate, or 0 */
+};
+
+struct pool {
+  const struct backend *backend;
+  void *backend_data;
+  long  slots;
+  int  verbosity;
+  int  own_children;
+  int  counters;		/* attach performance counters to the jobs */
+  int  counters_warned;		/* a failure to attach them was reported */
+  int  wait_errno;		/* errno of a failed wait, or 0 */
+  struct sched *sched;
+  struct cache *cache;
+  struct results *results;
+  struct archive *archive;
+  struct jobserver *js;
+  struct halt_policy  halt;
+  struct pressure_policy  pressure;
+  struct priority  prio;		/* default scheduling hints of the jobs */
+  struct priority  parent_prio;	/* nice level and I/O priority of the
+				   main thread */
+  double  next_check;		/* next time to measure the load */
+  double  speculate;		/* factor for starting backups, or 0 */
+  double *runtimes;		/* recent run times, used as a ring buffer */
+  long  n_runtimes;		/* number of run times recorded so far */
+  double  next_speculation;	/* next time to look for slow jobs */
+  double  runtime_total;	/* run time of the jobs in N_TIMED */
+  long  n_timed;		/* finished jobs which were not killed */
+  struct heartbeat_policy  heartbeat;
+  int  heartbeat_fd[2];		/* the heartbeat channel, or -1 */
+  double  next_heartbeat_check;	/* no job goes silent before this time */
+
+  job_source_fn  source;	/* where to get more jobs from, or NULL */
+  void *source_data;
+  int  source_fd;		/* readable once the source has a job, or -1 */
+  pool_callback  callback;
+  void *callback_data;
+
+  struct job *running;		/* most recently started job first */
+  struct job **by_pid;		/* hash table of the running jobs */
+  long  by_pid_size, by_pid_used;
+  int  epoll_fd;		/* watches the pidfds of the jobs, or -1 */
+  long  n_untracked;		/* running jobs without a pidfd */
+  long  n_killing;		/* running jobs with 'kill_time' set */
+  long  next_id;
+
+  int  spawners;		/* threads for starting jobs, or 0 */
+  int  spawning;		/* spawner threads are active */
+  sigset_t  spawn_mask;		/* signal mask for the children */
+  struct pool_stats  stats;
+  int  wake_fd[2];		/* written to by the signal handlers */
+  sig_atomic_t  dumps_seen, drains_seen;
+
+  int  control_fd[2];		/* the control FIFO, opened both ways */
+  char *control_path;		/* FIFO to remove at the end, or NULL */
+  char  control_buf[256];	/* incomplete control command */
+  size_t  control_len;
+};
+
+
+/**********************************************************************
+ * signal handling
+ */
+
+/* Signal handlers wake up all pools by writing to their pipes (the
+ * "self-pipe trick").  */
+#define MAX_POOLS 16
+static int  wake_fds[MAX_POOLS];
+static int  n_wake_fds;
+static volatile sig_atomic_t  interrupted;
+static volatile sig_atomic_t  n_dump_requests, n_drain_requests;
+
+static void
+wake_up(void)
+{
+  int  saved_errno = errno;
+  int  i;
+
+  for (i=0; i<n_wake_fds; ++i)
+    write(wake_fds[i], "", 1);
+  errno = saved_errno;
+}
+
+static void
+sigchld_handler(int signum)
+{
+  wake_up();
+}
+
+static void
+sigterm_handler(int signum)
+{
+  interrupted = signum;
+  wake_up();
+}
+
+static void
+sigusr_handler(int signum)
+{
+  if (signum == SIGUSR1)
+    ++n_dump_requests;
+  else
+    ++n_drain_requests;
+  wake_up();
+}
+
+static int
+add_wake_fd(int fd)
+/* Register the wake-up pipe of a new pool with the signal handler.
+ * Return 0 on success and -1 if there are too many pools.  */
+{
+  sigset_t  mask, old_mask;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGHUP);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &mask, &old_mask);
+  if (n_wake_fds == MAX_POOLS) {
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return -1;
+  }
+  wake_fds[n_wake_fds++] = fd;
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  return 0;
+}
+
+static void
+remove_wake_fd(int fd)
+{
+  sigset_t  mask, old_mask;
+  int  i;
+
+  sigfillset(&mask);
+  sigprocmask(SIG_BLOCK, &mask, &old_mask);
+  for (i=0; i<n_wake_fds; ++i) {
+    if (wake_fds[i] == fd) {
+      wake_fds[i] = wake_fds[--n_wake_fds];
+      break;
+    }
+  }
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+static void
+setup_signals(int handle_signals)
+{
+  struct sigaction  sa;
+
+  memset(&sa, 0, sizeof(sa));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_NOCLDSTOP;
+  sa.sa_handler = sigchld_handler;
+  sigaction(SIGCHLD, &sa, NULL);
+  if (handle_signals) {
+    sa.sa_flags = 0;
+    sa.sa_handler = sigterm_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = sigusr_handler;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+  }
+}
+
+double
+current_time(void)
+/* Return the time of the monotonic clock, in seconds.  */
+{
+  struct timespec  ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void
+wait_for_event(struct pool *pool, double timeout, int fd)
+/* Sleep until a signal arrives, until FD, the control FIFO, the
+ * heartbeat channel or the job source becomes readable, or until
+ * TIMEOUT seconds have passed.  A negative TIMEOUT means no time
+ * limit, a negative FD is ignored.  */
+{
+  struct pollfd  pfd[5];
+  int  n = 1;
+
+  pfd[0].fd = pool->wake_fd[0];
+  pfd[0].events = POLLIN;
+  if (fd >= 0) {
+    pfd[n].fd = fd;
+    pfd[n++].events = POLLIN;
+  }
+  if (pool->control_fd[0] >= 0) {
+    pfd[n].fd = pool->control_fd[0];
+    pfd[n++].events = POLLIN;
+  }
+  if (pool->heartbeat.timeout > 0 && pool->heartbeat_fd[0] >= 0) {
+    pfd[n].fd = pool->heartbeat_fd[0];
+    pfd[n++].events = POLLIN;
+  }
+  if (pool->source && pool->source_fd >= 0) {
+    pfd[n].fd = pool->source_fd;
+    pfd[n++].events = POLLIN;
+  }
+  poll(pfd, n, timeout < 0 ? -1 : (int)(timeout * 1000 + 1));
+}
+
+static void
+drain_wake_fd(struct pool *pool)
+{
+  char  buffer[64];
+
+  while (read(pool->wake_fd[0], buffer, sizeof(buffer)) > 0)
+    ;
+}
+
+
+/**********************************************************************
+ * policies
+ */
+
+static int
+parse_halt(const char *arg, struct halt_policy *halt)
+/* Parse a halt policy of the form "[soon|now][,fail=N[%]]".  Return 0
+ * on success and -1 on error.  */
+{
+  const char *ptr = arg;
+
+  halt->mode = halt_SOON;
+  halt->fail_count = 1;
+  halt->fail_percent = 0;
+  while (*ptr) {
+    size_t  len = strcspn(ptr, ",");
+    if (len == 4 && strncmp(ptr, "soon", 4) == 0) {
+      halt->mode = halt_SOON;
+    } else if (len == 3 && strncmp(ptr, "now", 3) == 0) {
+      halt->mode = halt_NOW;
+    } else if (len == 5 && strncmp(ptr, "never", 5) == 0) {
+      halt->mode = halt_NEVER;
+    } else if (len > 5 && strncmp(ptr, "fail=", 5) == 0) {
+      char *tail;
+      double  val;
+      errno = 0;
+      val = strtod(ptr+5, &tail);
+      if (tail == ptr+5 || errno || val <= 0)
+	return -1;
+      if (*tail == '%') {
+	++tail;
+	if (val > 100)
+	  return -1;
+	halt->fail_percent = val;
+	halt->fail_count = 0;
+      } else {
+	if (val != (long)val)
+	  return -1;
+	halt->fail_count = val;
+	halt->fail_percent = 0;
+      }
+      if (tail != ptr+len)
+	return -1;
+    } else {
+      return -1;
+    }
+    ptr += len;
+    if (*ptr == ',')
+      ++ptr;
+  }
+  return 0;
+}
+
+static int
+halt_triggered(const struct pool *pool)
+{
+  const struct halt_policy *halt = &pool->halt;
+  long  n_done = pool->stats.done;
+  long  n_failed = pool->stats.failed;
+
+  if (halt->mode == halt_NEVER || n_failed == 0)
+    return 0;
+  if (halt->fail_count > 0 && n_failed >= halt->fail_count)
+    return 1;
+  if (halt->fail_percent > 0 && n_done >= HALT_MIN_JOBS
+      && 100.0 * n_failed >= halt->fail_percent * n_done)
+    return 1;
+  return 0;
+}
+
+static void
+update_tokens(struct pool *pool, int want_more)
+/* Hold one jobserver token for every cpu used by the running jobs,
+ * except for the implicit slot of parallel itself.  If WANT_MORE is
+ * set, try to get enough tokens to also start the pending jobs.  */
+{
+  struct jobserver *js = pool->js;
+  long  want;
+
+  want = want_more ? sched_demand(pool->sched) : sched_cpus_used(pool->sched);
+  while (1 + jobserver_held(js) < want && jobserver_acquire(js))
+    ;
+  while (jobserver_held(js) > 0 && 1 + jobserver_held(js) > want)
+    jobserver_release(js);
+  sched_set_limit(pool->sched, 1 + jobserver_held(js));
+}
+
+
+/**********************************************************************
+ * the job table
+ */
+
+/* The running jobs are kept in a hash table indexed by process ID,
+ * using open addressing with linear probing, so that a finished job is
+ * found in constant time even with thousands of jobs running.  */
+
+static long
+pid_slot(const struct pool *pool, pid_t pid)
+{
+  return ((unsigned long)pid * 2654435761UL) & (pool->by_pid_size - 1);
+}
+
+static void
+pid_table_add(struct pool *pool, struct job *job)
+{
+  long  mask, i;
+
+  if (2 * (pool->by_pid_used + 1) > pool->by_pid_size) {
+    struct job **old = pool->by_pid;
+    long  old_size = pool->by_pid_size;
+
+    pool->by_pid_size = old_size ? 2 * old_size : 64;
+    pool->by_pid = xnew(struct job *, pool->by_pid_size);
+    memset(pool->by_pid, 0, pool->by_pid_size * sizeof(struct job *));
+    pool->by_pid_used = 0;
+    for (i=0; i<old_size; ++i) {
+      if (old[i])
+	pid_table_add(pool, old[i]);
+    }
+    xfree(old);
+  }
+
+  mask = pool->by_pid_size - 1;
+  for (i = pid_slot(pool, job->pid); pool->by_pid[i]; i = (i+1) & mask)
+    ;
+  pool->by_pid[i] = job;
+  ++pool->by_pid_used;
+}
+
+static long
+pid_table_find(const struct pool *pool, pid_t pid)
+/* Return the slot of the job with process ID PID, or -1.  */
+{
+  long  mask = pool->by_pid_size - 1;
+  long  i;
+
+  if (pool->by_pid_size == 0)
+    return -1;
+  for (i = pid_slot(pool, pid); pool->by_pid[i]; i = (i+1) & mask) {
+    if (pool->by_pid[i]->pid == pid)
+      return i;
+  }
+  return -1;
+}
+
+static struct job *
+pid_table_remove(struct pool *pool, pid_t pid)
+{
+  long  mask = pool->by_pid_size - 1;
+  long  i, j, k;
+  struct job *job;
+
+  i = pid_table_find(pool, pid);
+  if (i < 0)
+    return NULL;
+  job = pool->by_pid[i];
+  pool->by_pid[i] = NULL;
+  --pool->by_pid_used;
+
+  /* Move later entries of the cluster into the gap, unless their home
+   * slot K lies cyclically in (I, J].  */
+  for (j = (i+1) & mask; pool->by_pid[j]; j = (j+1) & mask) {
+    k = pid_slot(pool, pool->by_pid[j]->pid);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+    pool->by_pid[i] = pool->by_pid[j];
+    pool->by_pid[j] = NULL;
+    i = j;
+  }
+  return job;
+}
+
+
+/**********************************************************************
+ * the process backend
+ */
+
+#ifdef HAVE_POSIX_SPAWN
+static int
+spawn_priority(const struct pool *pool, const struct priority *prio,
+	       int in_thread)
+/* There are no spawn attributes for the nice level and the I/O
+ * priority, but the child inherits them from the calling thread.  If
+ * IN_THREAD is set, the calling thread takes on the settings of PRIO,
+ * with unset ones reset to those of the main thread.  The main thread
+ * keeps its settings, so it can only spawn jobs which run with them
+ * itself.  Return 0 if the calling thread can spawn the job with the
+ * settings of PRIO, and -1 otherwise.  */
+{
+  struct priority  full;
+
+  priority_merge(&full, prio, &pool->parent_prio);
+  if (in_thread)
+    return set_thread_priority(&full);
+  return (full.nice == pool->parent_prio.nice
+	  && full.ioprio == pool->parent_prio.ioprio) ? 0 : -1;
+}
+
+static int
+spawn_job(const struct pool *pool, struct job *job,
+	  const struct priority *prio, const sigset_t *child_mask)
+/* Start JOB with posix_spawn().  Unlike fork(), this does not copy the
+ * page tables of the parent, so the cost of starting a job does not
+ * grow with the size of the parent.  The caller must have applied
+ * 'spawn_priority' to PRIO.  Return 0 on success and -1 on error, with
+ * errno set.  */
+{
+  posix_spawn_file_actions_t  fa;
+  posix_spawnattr_t  attr;
+  struct sched_param  param;
+  sigset_t  defaults;
+  short  flags;
+  char *sh_argv[4];
+  pid_t  pid;
+  int  i, rc;
+  static const int  fds[3] = { 0, 1, 2 };
+  int  job_fds[3];
+
+  posix_spawn_file_actions_init(&fa);
+  job_fds[0] = job->in_fd;
+  job_fds[1] = job->out_fd;
+  job_fds[2] = job->err_fd;
+  for (i=0; i<3; ++i) {
+    if (job_fds[i] < 0)
+      continue;
+    posix_spawn_file_actions_adddup2(&fa, job_fds[i], fds[i]);
+  }
+
+  posix_spawnattr_init(&attr);
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGCHLD);
+  sigaddset(&defaults, SIGINT);
+  sigaddset(&defaults, SIGTERM);
+  sigaddset(&defaults, SIGHUP);
+  sigaddset(&defaults, SIGUSR1);
+  sigaddset(&defaults, SIGUSR2);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, child_mask);
+  posix_spawnattr_setpgroup(&attr, 0);
+  flags = (POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK
+	   | POSIX_SPAWN_SETPGROUP);
+  if (prio->policy != PRIORITY_UNSET) {
+    memset(&param, 0, sizeof(param));
+    posix_spawnattr_setschedpolicy(&attr, prio->policy);
+    posix_spawnattr_setschedparam(&attr, &param);
+    flags |= POSIX_SPAWN_SETSCHEDULER;
+  }
+  posix_spawnattr_setflags(&attr, flags);
+
+  if (job->argv) {
+    rc = posix_spawnp(&pid, job->argv[0], &fa, &attr, job->argv, environ);
+  } else {
+    sh_argv[0] = "sh";
+    sh_argv[1] = "-c";
+    sh_argv[2] = job->cmd;
+    sh_argv[3] = NULL;
+    rc = posix_spawn(&pid, "/bin/sh", &fa, &attr, sh_argv, environ);
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&fa);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  job->pid = pid;
+  return 0;
+}
+
+#ifdef HAVE_PTHREAD
+struct spawn_request {
+  const struct pool *pool;
+  struct job *job;
+  const struct priority *prio;
+  const sigset_t *child_mask;
+  int  rc, err;
+};
+
+static void *
+spawn_main(void *arg)
+{
+  struct spawn_request *req = arg;
+
+  req->rc = -1;
+  if (spawn_priority(req->pool, req->prio, 1) == 0)
+    req->rc = spawn_job(req->pool, req->job, req->prio, req->child_mask);
+  req->err = errno;
+  return NULL;
+}
+
+static int
+spawn_in_thread(const struct pool *pool, struct job *job,
+		const struct priority *prio, const sigset_t *child_mask)
+/* Spawn JOB from a new thread, which can take on the nice level and
+ * the I/O priority of the job without affecting the main thread.  This
+ * is still much cheaper than fork() for a large parent.  All signals
+ * must be blocked.  Return 0 on success and -1 on error, with errno
+ * set.  */
+{
+  struct spawn_request  req;
+  pthread_t  thread;
+  int  rc;
+
+  req.pool = pool;
+  req.job = job;
+  req.prio = prio;
+  req.child_mask = child_mask;
+  rc = pthread_create(&thread, NULL, spawn_main, &req);
+  if (rc != 0) {
+    errno = rc;
+    return -1;
+  }
+  pthread_join(thread, NULL);
+  errno = req.err;
+  return req.rc;
+}
+#endif
+#endif
+
+static int
+fork_job(const struct pool *pool, struct job *job)
+/* Fork a child process to run JOB.  Return 0 on success and -1 if the
+ * child could not be started, with errno set.  */
+{
+  struct priority  prio;
+  pid_t  pid;
+  sigset_t  mask, old_mask;
+  int  sync_fd[2] = { -1, -1 };
+  char  c;
+
+  /* With performance counters, the child waits before exec() until the
+   * counters are attached.  */
+  if (pool->counters && pipe(sync_fd) < 0)
+    return -1;
+
+  /* Until the child has reset its signal handlers, signals sent to its
+   * process group must not reach the handlers of the parent.  */
+  sigfillset(&mask);
+  sigprocmask(SIG_BLOCK, &mask, &old_mask);
+  pid = fork();
+  if (pid == -1) {
+    int  saved_errno = errno;
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (sync_fd[0] >= 0) {
+      close(sync_fd[0]);
+      close(sync_fd[1]);
+    }
+    errno = saved_errno;
+    return -1;
+  } else if (pid == 0) {
+    /* child process */
+
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGUSR1, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    /* in a spawner thread, OLD_MASK blocks all signals */
+    sigprocmask(SIG_SETMASK, pool->spawning ? &pool->spawn_mask : &old_mask,
+		NULL);
+    setpgid(0, 0);
+    priority_merge(&prio, &job->prio, &pool->prio);
+    set_priority(0, &prio);
+    if (job->in_fd >= 0) {
+      dup2(job->in_fd, 0);
+      close(job->in_fd);
+    }
+    if (job->out_fd >= 0) {
+      dup2(job->out_fd, 1);
+      close(job->out_fd);
+    }
+    if (job->err_fd >= 0) {
+      dup2(job->err_fd, 2);
+      close(job->err_fd);
+    }
+    if (sync_fd[0] >= 0) {
+      close(sync_fd[1]);
+      while (read(sync_fd[0], &c, 1) < 0 && errno == EINTR)
+	;
+      close(sync_fd[0]);
+    }
+
+    if (job->argv)
+      execvp(job->argv[0], job->argv);
+    else
+      execl("/bin/sh", "sh", "-c", job->cmd, NULL);
+    /* only returns in case of error */
+    fprintf(stderr, "error: failed to execute child process (%m)\n");
+    _exit(1);
+  }
+
+  /* parent process */
+  sigprocmask(SIG_SETMASK, &old_mask, NULL);
+  setpgid(pid, pid);
+  job->pid = pid;
+  if (sync_fd[0] >= 0) {
+    if (counters_attach(job) < 0)
+      job->no_counters = 1;
+    close(sync_fd[0]);
+    c = 0;
+    write(sync_fd[1], &c, 1);
+    close(sync_fd[1]);
+  }
+  return 0;
+}
+
+static int
+process_start(struct job *job, void *data)
+/* Start a child process to run JOB.  Return 0 on success and -1 if the
+ * child could not be started, with errno set.  This is called from
+ * the spawner threads, too.  */
+{
+  const struct pool *pool = data;
+
+#ifdef HAVE_POSIX_SPAWN
+  struct priority  prio;
+
+  /* counters must be attached between fork() and exec() */
+  priority_merge(&prio, &job->prio, &pool->prio);
+  if (! pool->counters) {
+    sigset_t  mask, old_mask;
+    int  rc, spawned = 1;
+
+    sigfillset(&mask);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    if (spawn_priority(pool, &prio, pool->spawning) == 0)
+      rc = spawn_job(pool, job, &prio,
+		     pool->spawning ? &pool->spawn_mask : &old_mask);
+#ifdef HAVE_PTHREAD
+    else if (! pool->spawning)
+      rc = spawn_in_thread(pool, job, &prio, &old_mask);
+#endif
+    else {
+      /* the spawner thread cannot take on the priority */
+      rc = -1;
+      spawned = 0;
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc == 0)
+      return 0;
+    /* In the main thread, fork() reports a failed exec() like
+     * before.  */
+    if (pool->spawning && spawned)
+      return -1;
+  }
+#endif
+  return fork_job(pool, job);
+}
+
+static void
+process_signal(const struct job *job, int signum, void *data)
+{
+  killpg(job->pid, signum);
+}
+
+static pid_t
+process_reap(const struct job *running, int *status_p, void *data)
+/* Return the process ID of a finished child, 0 if none has finished,
+ * or -1 if waiting failed.  */
+{
+  const struct pool *pool = data;
+  const struct job *job;
+  siginfo_t  info;
+  pid_t  pid;
+
+  if (pool->own_children) {
+    pid = waitpid(-1, status_p, WNOHANG);
+    if (pid == -1 && errno != ECHILD && errno != EINTR)
+      return -1;
+    return pid > 0 ? pid : 0;
+  }
+
+  /* Other parts of the program may have children of their own, so
+   * only our jobs may be reaped.  The pidfd of a job becomes readable
+   * once the job has finished, and is closed in 'find_job'.  */
+#ifdef USE_PIDFD
+  if (pool->epoll_fd >= 0) {
+    struct epoll_event  ev;
+    long  i;
+    while (epoll_wait(pool->epoll_fd, &ev, 1, 0) == 1) {
+      pid = waitpid((pid_t)ev.data.u64, status_p, WNOHANG);
+      if (pid > 0)
+	return pid;
+      /* reaped by someone else, so it cannot be reported */
+      i = pid_table_find(pool, (pid_t)ev.data.u64);
+      if (i >= 0)
+	epoll_ctl(pool->epoll_fd, EPOLL_CTL_DEL, pool->by_pid[i]->pidfd, NULL);
+    }
+    if (pool->n_untracked == 0)
+      return 0;
+  }
+#endif
+
+  /* Without pidfds, peek at a finished child without reaping it, and
+   * only check the jobs one by one if it is not one of ours.  */
+  memset(&info, 0, sizeof(info));
+  if (waitid(P_ALL, 0, &info, WEXITED|WNOHANG|WNOWAIT) < 0
+      || info.si_pid == 0)
+    return 0;
+  if (pid_table_find(pool, info.si_pid) >= 0) {
+    pid = waitpid(info.si_pid, status_p, WNOHANG);
+    if (pid == info.si_pid)
+      return pid;
+  }
+  for (job = running; job; job = job->next) {
+    if (job->pidfd >= 0)
+      continue;
+    pid = waitpid(job->pid, status_p, WNOHANG);
+    if (pid == job->pid)
+      return pid;
+  }
+  return 0;
+}
+
+static double
+process_now(void *data)
+{
+  return current_time();
+}
+
+static void
+process_wait(double timeout, int fd, void *data)
+{
+  wait_for_event(data, timeout, fd);
+}
+
+static const struct backend  process_backend = {
+  process_start, process_signal, process_reap, process_now, process_wait
+};
+
+
+/**********************************************************************
+ * running jobs
+ */
+
+static void
+watch_job(struct pool *pool, struct job *job)
+/* Add the pidfd of the newly started JOB to the epoll set.  Jobs whose
+ * pidfd cannot be opened, e.g. because the process runs out of file
+ * descriptors, are left to the slow path of 'process_reap'.  */
+{
+#ifdef USE_PIDFD
+  struct epoll_event  ev;
+
+  if (pool->epoll_fd >= 0) {
+    job->pidfd = syscall(SYS_pidfd_open, job->pid, 0);
+    if (job->pidfd >= 0) {
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.u64 = job->pid;
+      if (epoll_ctl(pool->epoll_fd, EPOLL_CTL_ADD, job->pidfd, &ev) == 0)
+	return;
+      close(job->pidfd);
+      job->pidfd = -1;
+    }
+  }
+#endif
+  ++pool->n_untracked;
+}
+
+static void
+job_started(struct pool *pool, struct job *job)
+/* Record that the backend has started JOB.  */
+{
+  struct timeval  tv;
+
+  job->start_time = pool->backend->now(pool->backend_data);
+  job->last_beat = job->start_time;
+  gettimeofday(&tv, NULL);
+  job->start_wall = tv.tv_sec + 1e-6 * tv.tv_usec;
+  if (job->in_fd >= 0) {
+    close(job->in_fd);
+    job->in_fd = -1;
+  }
+  if (job->out_fd >= 0) {
+    close(job->out_fd);
+    job->out_fd = -1;
+  }
+  if (job->err_fd >= 0) {
+    close(job->err_fd);
+    job->err_fd = -1;
+  }
+  job->prev = NULL;
+  job->next = pool->running;
+  if (pool->running)
+    pool->running->prev = job;
+  pool->running = job;
+  pid_table_add(pool, job);
+  if (pool->backend == &process_backend && ! pool->own_children)
+    watch_job(pool, job);
+  ++pool->stats.running;
+  if (pool->verbosity >= 1)
+    message("%ld: %s (pid %d)", job->cmd_no, job->cmd, (int)job->pid);
+  if (job->no_counters && ! pool->counters_warned) {
+    warning("warning: cannot attach performance counters to command %ld,"
+	    " further failures are not reported", job->cmd_no);
+    pool->counters_warned = 1;
+  } else if (job->no_counters && pool->verbosity >= 2) {
+    message("%ld: cannot attach performance counters", job->cmd_no);
+  }
+}
+
+static int
+start_job(struct pool *pool, struct job *job)
+/* Start JOB using the backend of the pool.  Return 0 on success and -1
+ * if the job could not be started.  */
+{
+  if (pool->backend->start(job, pool->backend_data) < 0) {
+    error("error: cannot start command %ld (%m)", job->cmd_no);
+    return -1;
+  }
+  job_started(pool, job);
+  return 0;
+}
+
+static struct job *
+find_job(struct pool *pool, pid_t pid)
+/* Remove the job with process ID PID from the list of running jobs.  */
+{
+  struct job *job;
+
+  job = pid_table_remove(pool, pid);
+  if (! job)
+    return NULL;
+  if (job->pidfd >= 0) {
+    close(job->pidfd);
+    job->pidfd = -1;
+  } else if (pool->backend == &process_backend && ! pool->own_children) {
+    --pool->n_untracked;
+  }
+  if (job->prev)
+    job->prev->next = job->next;
+  else
+    pool->running = job->next;
+  if (job->next)
+    job->next->prev = job->prev;
+  job->next = job->prev = NULL;
+  --pool->stats.running;
+  if (job->paused)
+    --pool->stats.paused;
+  if (job->kill_time > 0)
+    --pool->n_killing;
+  return job;
+}
+
+static void
+send_signal(struct pool *pool, const struct job *job, int signum)
+{
+  pool->backend->signal(job, signum, pool->backend_data);
+}
+
+static void
+terminate_job(struct pool *pool, struct job *job, double now)
+/* Send SIGTERM to the process group of JOB.  If the job is still
+ * running after KILL_DELAY seconds, 'kill_stragglers' uses SIGKILL.  */
+{
+  if (job->kill_time > 0)
+    return;
+  send_signal(pool, job, SIGTERM);
+  if (job->paused)
+    send_signal(pool, job, SIGCONT);
+  job->kill_time = now + KILL_DELAY;
+  ++pool->n_killing;
+}
+
+static double
+kill_stragglers(struct pool *pool, double now)
+/* Send SIGKILL to all jobs which ignored SIGTERM for too long.  Return
+ * the number of seconds until the next job needs to be killed, or -1
+ * if no kills are pending.  */
+{
+  struct job *job;
+  double  next = -1;
+
+  if (pool->n_killing == 0)
+    return -1;
+  for (job = pool->running; job; job = job->next) {
+    if (job->kill_time <= 0)
+      continue;
+    if (job->kill_time <= now) {
+      send_signal(pool, job, SIGKILL);
+      job->kill_time = now + KILL_DELAY;
+    }
+    if (next < 0 || job->kill_time - now < next)
+      next = job->kill_time - now;
+  }
+  return next;
+}
+
+static void
+close_heartbeat(struct pool *pool)
+{
+  if (pool->heartbeat_fd[0] < 0)
+    return;
+  close(pool->heartbeat_fd[0]);
+  close(pool->heartbeat_fd[1]);
+  pool->heartbeat_fd[0] = pool->heartbeat_fd[1] = -1;
+  unsetenv("PARALLEL_HEARTBEAT_FD");
+}
+
+static struct job *
+job_of_process(const struct pool *pool, pid_t pid)
+/* Return the running job which the process PID belongs to, or NULL.
+ * Every job runs in its own process group.  */
+{
+  long  i;
+  pid_t  pgid;
+
+  i = pid_table_find(pool, pid);
+  if (i < 0 && (pgid = getpgid(pid)) > 0)
+    i = pid_table_find(pool, pgid);
+  return i >= 0 ? pool->by_pid[i] : NULL;
+}
+
+static void
+read_heartbeats(struct pool *pool, double now)
+/* Record the heartbeats which have arrived since the last call.  */
+{
+  struct job *job;
+  double  progress;
+  pid_t  pid;
+  int  i;
+
+  for (i=0; i<HEARTBEAT_MESSAGES; ++i) {
+    if (read_heartbeat(pool->heartbeat_fd[0], &pid, &progress) <= 0)
+      break;
+    job = job_of_process(pool, pid);
+    if (! job)
+      continue;
+    job->last_beat = now;
+    if (progress >= 0)
+      job->progress = progress;
+  }
+}
+
+static double
+check_heartbeats(struct pool *pool, double now)
+/* Terminate all jobs which have not sent a heartbeat for too long.
+ * Suspended jobs are exempt.  Return the number of seconds until the
+ * next job may go silent, or -1 if no check is needed.  */
+{
+  struct job *job;
+  double  silent, next;
+
+  if (! pool->running)
+    return -1;
+  if (now < pool->next_heartbeat_check)
+    return pool->next_heartbeat_check - now;
+
+  next = pool->heartbeat.timeout;
+  for (job = pool->running; job; job = job->next) {
+    if (job->paused || job->kill_time > 0)
+      continue;
+    silent = now - job->last_beat;
+    if (silent >= pool->heartbeat.timeout) {
+      if (pool->verbosity >= 1)
+	message("%ld: no heartbeat for %.1f seconds, terminating",
+		job->cmd_no, silent);
+      job->stalled = 1;
+      ++pool->stats.stalled;
+      terminate_job(pool, job, now);
+    } else if (pool->heartbeat.timeout - silent < next) {
+      next = pool->heartbeat.timeout - silent;
+    }
+  }
+  pool->next_heartbeat_check = now + next;
+  return next;
+}
+
+static double
+estimate_eta(const struct pool *pool, double now)
+/* Estimate the number of seconds until all pending and running jobs
+ * have finished, or return -1 if nothing is known yet.  The remaining
+ * time of a job which reports its progress is extrapolated from its
+ * run time so far; all other jobs are assumed to take the mean run
+ * time of the finished jobs.  */
+{
+  const struct job *job;
+  double  mean = -1, work = 0, longest = 0, elapsed, left;
+
+  if (pool->n_timed > 0)
+    mean = pool->runtime_total / pool->n_timed;
+  for (job = pool->running; job; job = job->next) {
+    if (job->lost)
+      continue;
+    elapsed = (job->paused ? job->pause_start : now)
+      - job->start_time - job->paused_time;
+    if (job->progress > 0)
+      left = elapsed * (1 - job->progress) / job->progress;
+    else if (mean >= 0)
+      left = mean > elapsed ? mean - elapsed : 0;
+    else
+      return -1;
+    work += left * job->cpus;
+    if (left > longest)
+      longest = left;
+  }
+  if (pool->stats.pending > 0) {
+    if (mean < 0)
+      return -1;
+    work += pool->stats.pending * mean;
+  }
+  left = work / pool->slots;
+  return left > longest ? left : longest;
+}
+
+static double
+check_pressure(struct pool *pool, double now)
+/* Suspend the most recently started job if the machine is too busy,
+ * resume the most recently suspended job once the load has dropped.
+ * Return the number of seconds until the next check.  */
+{
+  struct job *job, *last;
+  double  value;
+
+  if (now < pool->next_check)
+    return pool->next_check - now;
+  pool->next_check = now + PRESSURE_INTERVAL;
+  if (read_pressure(&pool->pressure, &value) < 0)
+    return PRESSURE_INTERVAL;
+
+  if (value > pool->pressure.high) {
+    for (job = pool->running; job; job = job->next) {
+      if (! job->paused && job->kill_time <= 0)
+	break;
+    }
+    if (job) {
+      send_signal(pool, job, SIGSTOP);
+      job->paused = 1;
+      job->pause_start = now;
+      ++pool->stats.paused;
+      if (pool->verbosity >= 1)
+	message("%ld: suspended (pid %d, load %.2f)",
+		job->cmd_no, (int)job->pid, value);
+      pool->next_check = now + pool->pressure.window;
+      return pool->pressure.window;
+    }
+  } else if (value < pool->pressure.low && pool->stats.paused > 0) {
+    last = NULL;
+    for (job = pool->running; job; job = job->next) {
+      if (job->paused && (! last || job->pause_start > last->pause_start))
+	last = job;
+    }
+    job = last;
+    send_signal(pool, job, SIGCONT);
+    job->paused = 0;
+    job->paused_time += now - job->pause_start;
+    /* a stopped job cannot send heartbeats */
+    job->last_beat = now;
+    --pool->stats.paused;
+    if (pool->verbosity >= 1)
+      message("%ld: resumed (pid %d, load %.2f)",
+	      job->cmd_no, (int)job->pid, value);
+    pool->next_check = now + pool->pressure.window;
+    return pool->pressure.window;
+  }
+  return PRESSURE_INTERVAL;
+}
+
+static void
+record_runtime(struct pool *pool, const struct job *job)
+{
+  double  t = job->end_time - job->start_time - job->paused_time;
+
+  if (job->kill_time > 0)
+    return;
+  pool->runtime_total += t;
+  ++pool->n_timed;
+  if (pool->runtimes)
+    pool->runtimes[pool->n_runtimes++ % SPECULATE_SAMPLES] = t;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double  x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+median_runtime(const struct pool *pool)
+{
+  double  sorted[SPECULATE_SAMPLES];
+  long  n = pool->n_runtimes;
+
+  if (n > SPECULATE_SAMPLES)
+    n = SPECULATE_SAMPLES;
+  memcpy(sorted, pool->runtimes, n * sizeof(double));
+  qsort(sorted, n, sizeof(double), compare_double);
+  return sorted[n/2];
+}
+
+static int
+capture_output(struct job *job)
+/* Let JOB write its output to buffer files, so that only the output of
+ * the copy of a speculated job which finishes first is shown.  Return
+ * 0 on success and -1 on error.  */
+{
+  job->spec_out = new_buffer_file();
+  job->spec_err = new_buffer_file();
+  if (job->spec_out < 0 || job->spec_err < 0)
+    return -1;
+  job->out_fd = fcntl(job->spec_out, F_DUPFD_CLOEXEC, 0);
+  job->err_fd = fcntl(job->spec_err, F_DUPFD_CLOEXEC, 0);
+  return (job->out_fd >= 0 && job->err_fd >= 0) ? 0 : -1;
+}
+
+static void
+replay_output(struct job *job)
+/* Copy the output captured by 'capture_output' to the result files of
+ * JOB, or to stdout and stderr.  */
+{
+  if (job->spec_out < 0)
+    return;
+  if (lseek(job->spec_out, 0, SEEK_SET) < 0
+      || copy_fd(job->spec_out, job_output_fd(job, 1)) < 0
+      || lseek(job->spec_err, 0, SEEK_SET) < 0
+      || copy_fd(job->spec_err, job_output_fd(job, 2)) < 0)
+    error("error: cannot replay output of command %ld (%m)", job->cmd_no);
+  close(job->spec_out);
+  close(job->spec_err);
+  job->spec_out = job->spec_err = -1;
+}
+
+static double
+speculate(struct pool *pool, double now)
+/* Once all jobs have been started, use idle cpus to run a second copy
+ * of the job which has been running for longest, if it has taken much
+ * longer than the median.  Return the number of seconds until the next
+ * check, or -1 if no check is needed.  */
+{
+  struct job *job, *slowest = NULL, *backup;
+  double  median, elapsed, longest = 0;
+
+  if (pool->source || pool->stats.pending > 0 || pool->stats.halted
+      || pool->stats.on_hold || pool->stats.paused > 0 || ! pool->running
+      || pool->n_runtimes < SPECULATE_MIN_JOBS)
+    return -1;
+  if (now < pool->next_speculation)
+    return pool->next_speculation - now;
+  pool->next_speculation = now + SPECULATE_INTERVAL;
+
+  median = median_runtime(pool);
+  for (job = pool->running; job; job = job->next) {
+    if (job->twin || job->backup || job->lost || job->kill_time > 0)
+      continue;
+    elapsed = now - job->start_time - job->paused_time;
+    if (elapsed > pool->speculate * median && elapsed > longest) {
+      slowest = job;
+      longest = elapsed;
+    }
+  }
+  if (! slowest)
+    return SPECULATE_INTERVAL;
+
+  backup = copy_job(slowest);
+
+  /* the backup must fit into the idle resources */
+  sched_add(pool->sched, backup);
+  if (sched_next(pool->sched) != backup) {
+    sched_remove(pool->sched, backup->cmd_no);
+    delete_job(backup);
+    return SPECULATE_INTERVAL;
+  }
+
+  backup->backup = 1;
+  if (capture_output(backup) < 0 || start_job(pool, backup) < 0) {
+    sched_release(pool->sched, backup);
+    delete_job(backup);
+    return SPECULATE_INTERVAL;
+  }
+  backup->twin = slowest;
+  slowest->twin = backup;
+  ++pool->stats.backups;
+  if (pool->verbosity >= 1)
+    message("%ld: started a second copy (running for %.1f seconds,"
+	    " median %.1f)", slowest->cmd_no, longest, median);
+  return SPECULATE_INTERVAL;
+}
+
+static void
+settle_race(struct pool *pool, struct job *winner)
+/* WINNER is the first copy of a speculated job to finish.  Kill the
+ * other copy and account for the time saved.  */
+{
+  struct job *loser = winner->twin;
+  double  saved;
+
+  winner->twin = NULL;
+  loser->twin = NULL;
+  loser->lost = 1;
+  terminate_job(pool, loser, winner->end_time);
+  if (! winner->backup) {
+    if (pool->verbosity >= 2)
+      message("%ld: the original copy finished first", winner->cmd_no);
+    return;
+  }
+
+  /* the output goes where the output of the original would have */
+  winner->result_out = loser->result_out;
+  winner->result_err = loser->result_err;
+  loser->result_out = loser->result_err = -1;
+
+  /* the original had not finished after running this much longer */
+  saved = ((winner->end_time - loser->start_time - loser->paused_time)
+	   - (winner->end_time - winner->start_time - winner->paused_time));
+  ++pool->stats.backups_won;
+  pool->stats.saved += saved;
+  if (pool->verbosity >= 1)
+    message("%ld: the second copy finished first, %.1f seconds saved",
+	    winner->cmd_no, saved);
+}
+
+static void
+report_status(const struct pool *pool, const struct job *job, int status)
+{
+  char  who[32];
+
+  if (pool->verbosity < 1)
+    return;
+
+  if (job->pid > 0)
+    sprintf(who, "pid %d", (int)job->pid);
+  else
+    sprintf(who, "command %ld", job->cmd_no);
+
+  if (WIFEXITED(status)) {
+    int rc = WEXITSTATUS(status);
+    if (rc) {
+      message("%s exited with status %d", who, rc);
+    } else if (pool->verbosity >= 2) {
+      message("%s completed", who);
+    }
+  } else if (WIFSIGNALED(status)) {
+    message("%s terminated by signal %d", who, WTERMSIG(status));
+  } else {
+    message("%s miraculously died", who);
+  }
+}
+
+static void
+report_counters(const struct pool *pool, const struct job *job)
+{
+  char  buffer[256];
+  size_t  len = 0;
+  int  i;
+
+  if (pool->verbosity < 1 || job->n_counters == 0)
+    return;
+  for (i=0; i<job->n_counters && len<sizeof(buffer); ++i)
+    len += snprintf(buffer+len, sizeof(buffer)-len, "%s%s %llu",
+		    i>0 ? ", " : "", counter_name(i), job->counter[i]);
+  message("%ld: %s", job->cmd_no, buffer);
+}
+
+static void
+finish_job(struct pool *pool, struct job *job, int status, int cached)
+/* Record the result of JOB, which has finished with wait status
+ * STATUS, and free the job.  Jobs killed by the pool itself do not
+ * count as failures.  */
+{
+  report_status(pool, job, status);
+  ++pool->stats.done;
+  if ((! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      && (job->kill_time <= 0 || job->stalled))
+    ++pool->stats.failed;
+  replay_output(job);
+  if (cached)
+    ++pool->stats.cached;
+  else if (pool->cache)
+    cache_store(pool->cache, job, status);
+  if (pool->results)
+    results_finish(pool->results, job, status, cached);
+  if (pool->archive)
+    archive_finish(pool->archive, job, status, cached, pool_now(pool));
+  sched_release(pool->sched, job);
+  if (pool->callback)
+    pool->callback(pool, job->cmd_no, status, pool->callback_data);
+  delete_job(job);
+}
+
+static void
+drop_job(struct pool *pool, struct job *job)
+/* Discard a job which was never started.  */
+{
+  ++pool->stats.cancelled;
+  if (pool->callback)
+    pool->callback(pool, job->cmd_no, -1, pool->callback_data);
+  delete_job(job);
+}
+
+static void
+halt_pool(struct pool *pool)
+/* Stop starting new jobs and discard the pending ones.  */
+{
+  struct job *job;
+
+  pool->stats.halted = 1;
+  pool->source = NULL;
+  while ((job = sched_remove(pool->sched, -1))) {
+    --pool->stats.pending;
+    drop_job(pool, job);
+  }
+}
+
+#ifdef HAVE_PTHREAD
+struct spawner {
+  struct pool *pool;
+  struct job **jobs;
+  int *errors;
+  long  n, first, step;
+};
+
+static void *
+spawner_main(void *arg)
+/* Start every STEP-th job of the batch.  */
+{
+  struct spawner *sp = arg;
+  struct pool *pool = sp->pool;
+  long  i;
+
+  for (i = sp->first; i < sp->n; i += sp->step) {
+    if (pool->backend->start(sp->jobs[i], pool->backend_data) < 0)
+      sp->errors[i] = errno ? errno : EIO;
+    else
+      sp->errors[i] = 0;
+  }
+  return NULL;
+}
+#endif
+
+static void
+start_failed(struct pool *pool, struct job *job)
+/* Discard JOB, which could not be started.  */
+{
+  cache_discard(job);
+  sched_release(pool->sched, job);
+  drop_job(pool, job);
+}
+
+static void
+start_batch(struct pool *pool, struct job **jobs, long n)
+/* Start the N given jobs, using the spawner threads.  Jobs which
+ * cannot be started by the threads are tried once more from the main
+ * thread, and are discarded if this fails, too.  */
+{
+  int  errors[SPAWN_BATCH];
+  long  i, n_threads = 0;
+#ifdef HAVE_PTHREAD
+  struct spawner  sp[MAX_SPAWNERS];
+  pthread_t  threads[MAX_SPAWNERS];
+  sigset_t  mask;
+  long  t, created;
+
+  assert(n <= SPAWN_BATCH);
+  n_threads = pool->spawners < n ? pool->spawners : n;
+  if (n_threads > 1) {
+    /* the threads must not handle signals meant for the main thread */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &pool->spawn_mask);
+    pool->spawning = 1;
+    for (t=0; t<n_threads; ++t) {
+      sp[t].pool = pool;
+      sp[t].jobs = jobs;
+      sp[t].errors = errors;
+      sp[t].n = n;
+      sp[t].first = t;
+      sp[t].step = n_threads;
+    }
+    for (created=0; created<n_threads; ++created) {
+      if (pthread_create(threads+created, NULL, spawner_main,
+			 sp+created) != 0)
+	break;
+    }
+    /* spawning changes the priority of the calling thread, so the
+     * main thread starts the jobs of the missing threads below */
+    for (t=created; t<n_threads; ++t)
+      for (i=t; i<n; i+=n_threads)
+	errors[i] = EAGAIN;
+    for (t=0; t<created; ++t)
+      pthread_join(threads[t], NULL);
+    pool->spawning = 0;
+    pthread_sigmask(SIG_SETMASK, &pool->spawn_mask, NULL);
+  }
+#endif
+
+  for (i=0; i<n; ++i) {
+    if (n_threads > 1 && errors[i] == 0)
+      job_started(pool, jobs[i]);
+    else if (start_job(pool, jobs[i]) < 0)
+      start_failed(pool, jobs[i]);
+  }
+}
+
+static void
+dispatch(struct pool *pool)
+/* Start as many pending jobs as the resources allow.  */
+{
+  struct job *job, *batch[SPAWN_BATCH];
+  long  n_batch = 0;
+  int  status;
+
+  /* while jobs are suspended, the machine is too busy for new ones */
+  while (! pool->stats.halted && ! pool->stats.on_hold
+	 && pool->stats.paused == 0) {
+    if (halt_triggered(pool)) {
+      error("error: %ld of %ld jobs failed, not starting new jobs",
+	    pool->stats.failed, pool->stats.done);
+      halt_pool(pool);
+      break;
+    }
+    while (pool->source) {
+      int  eof = 0;
+      job = pool->source(pool, &eof, pool->source_data);
+      if (! job) {
+	if (eof)
+	  pool->source = NULL;
+	break;
+      }
+      pool_add_job(pool, job);
+    }
+    if (pool->js)
+      update_tokens(pool, 1);
+    job = sched_next(pool->sched);
+    if (! job)
+      break;
+    --pool->stats.pending;
+
+    /* without its result files, the job is not started at all */
+    if ((pool->results && results_prepare(pool->results, job) < 0)
+	|| (pool->archive && job->out_fd < 0
+	    && archive_prepare(pool->archive, job) < 0)) {
+      start_failed(pool, job);
+      continue;
+    }
+    if (pool->cache && cache_lookup(pool->cache, job, &status)) {
+      if (pool->verbosity >= 1)
+	message("%ld: %s (cached)", job->cmd_no, job->cmd);
+      finish_job(pool, job, status, 1);
+      continue;
+    }
+    if (pool->cache)
+      cache_prepare(pool->cache, job);
+    if (pool->speculate > 0 && job->out_fd < 0
+	&& capture_output(job) < 0) {
+      error("error: cannot capture output of command %ld (%m)",
+	    job->cmd_no);
+      start_failed(pool, job);
+      continue;
+    }
+    if (job->out_fd < 0 && job->result_out >= 0) {
+      /* no need to capture the output, the child can write directly
+       * to the result files */
+      if (pool->archive) {
+	/* the archive reads the output back after the job */
+	job->out_fd = fcntl(job->result_out, F_DUPFD_CLOEXEC, 0);
+	job->err_fd = fcntl(job->result_err, F_DUPFD_CLOEXEC, 0);
+      } else {
+	job->out_fd = job->result_out;
+	job->err_fd = job->result_err;
+	job->result_out = job->result_err = -1;
+      }
+    }
+    if (n_batch > 0 || pool->spawners > 1) {
+      batch[n_batch++] = job;
+      if (n_batch == SPAWN_BATCH) {
+	start_batch(pool, batch, n_batch);
+	n_batch = 0;
+      }
+    } else if (start_job(pool, job) < 0) {
+      start_failed(pool, job);
+    }
+  }
+  if (n_batch > 0)
+    start_batch(pool, batch, n_batch);
+  if (pool->js)
+    update_tokens(pool, 0);
+}
+
+static void
+requeue_job(struct pool *pool, struct job *job)
+/* Put a copy of JOB, which was terminated for missing heartbeats, back
+ * into the queue, and free JOB.  */
+{
+  struct job *copy;
+
+  copy = copy_job(job);
+  copy->attempts = job->attempts + 1;
+  if (pool->verbosity >= 1)
+    message("%ld: starting again (attempt %d of %d)", job->cmd_no,
+	    copy->attempts + 1, pool->heartbeat.retries + 1);
+  if (job->cache_tmp)
+    cache_discard(job);
+  sched_release(pool->sched, job);
+  delete_job(job);
+  sched_add(pool->sched, copy);
+  ++pool->stats.pending;
+  ++pool->stats.requeued;
+}
+
+static int
+reap(struct pool *pool)
+/* Collect all finished jobs.  Return the number of jobs which have
+ * finished.  If waiting fails, 'pool->wait_errno' is set.  */
+{
+  struct job *job;
+  int  status, reaped = 0;
+  pid_t  pid = 0;
+
+  while (pool->running
+	 && (pid = pool->backend->reap(pool->running, &status,
+				       pool->backend_data)) > 0) {
+    job = find_job(pool, pid);
+    if (! job)
+      continue;
+    job->end_time = pool_now(pool);
+    if (job->paused)
+      job->paused_time += job->end_time - job->pause_start;
+    if (job->lost) {
+      /* the other copy of this job has already been reported */
+      sched_release(pool->sched, job);
+      delete_job(job);
+      ++reaped;
+      continue;
+    }
+    if (job->stalled && job->attempts < pool->heartbeat.retries
+	&& ! job->twin && ! pool->stats.halted) {
+      requeue_job(pool, job);
+      ++reaped;
+      continue;
+    }
+    if (job->twin)
+      settle_race(pool, job);
+    record_runtime(pool, job);
+    if (job->n_counters > 0) {
+      counters_collect(job);
+      report_counters(pool, job);
+    }
+    finish_job(pool, job, status, 0);
+    ++reaped;
+  }
+  if (pid < 0 && ! pool->wait_errno)
+    pool->wait_errno = errno ? errno : ECHILD;
+  return reaped;
+}
+
+
+/**********************************************************************
+ * the control FIFO
+ */
+
+static int
+open_control(struct pool *pool, const char *path)
+/* Open the FIFO PATH for reading commands, creating it if needed.
+ * Return 0 on success and -1 on error.  */
+{
+  struct stat  st;
+
+  if (mkfifo(path, 0600) == 0)
+    pool->control_path = xstrdup(path);
+  else if (errno != EEXIST)
+    return -1;
+
+  /* Keeping the FIFO open for writing, too, avoids end-of-file
+   * conditions when a writer closes it.  */
+  pool->control_fd[0] = open(path, O_RDONLY|O_NONBLOCK|O_CLOEXEC);
+  if (pool->control_fd[0] < 0)
+    return -1;
+  if (fstat(pool->control_fd[0], &st) < 0)
+    return -1;
+  if (! S_ISFIFO(st.st_mode)) {
+    errno = EINVAL;
+    return -1;
+  }
+  pool->control_fd[1] = open(path, O_WRONLY|O_NONBLOCK|O_CLOEXEC);
+  if (pool->control_fd[1] < 0)
+    return -1;
+  return 0;
+}
+
+static void
+close_control(struct pool *pool)
+{
+  if (pool->control_fd[0] >= 0)
+    close(pool->control_fd[0]);
+  if (pool->control_fd[1] >= 0)
+    close(pool->control_fd[1]);
+  pool->control_fd[0] = pool->control_fd[1] = -1;
+  if (pool->control_path) {
+    unlink(pool->control_path);
+    xfree(pool->control_path);
+    pool->control_path = NULL;
+  }
+}
+
+static void
+read_control(struct pool *pool)
+/* Execute all complete commands waiting in the control FIFO.  */
+{
+  char *start, *end;
+  ssize_t  n;
+
+  for (;;) {
+    n = read(pool->control_fd[0], pool->control_buf + pool->control_len,
+	     sizeof(pool->control_buf) - 1 - pool->control_len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    pool->control_len += n;
+    pool->control_buf[pool->control_len] = '\0';
+
+    start = pool->control_buf;
+    while ((end = strchr(start, '\n'))) {
+      *end = '\0';
+      if (*start && pool_control(pool, start) < 0)
+	error("error: invalid control command \"%s\"", start);
+      start = end+1;
+    }
+    pool->control_len -= start - pool->control_buf;
+    memmove(pool->control_buf, start, pool->control_len);
+    if (pool->control_len == sizeof(pool->control_buf) - 1) {
+      error("error: control command too long");
+      pool->control_len = 0;
+    }
+  }
+}
+
+
+/**********************************************************************
+ * global functions
+ */
+
+void
+pool_config_init(struct pool_config *cfg)
+/* Fill CFG with the default settings.  */
+{
+  memset(cfg, 0, sizeof(struct pool_config));
+  cfg->lookahead = 100;
+  cfg->cache_size = 1ULL << 30;
+  cfg->nice = 19;
+}
+
+struct pool *
+new_pool(const struct pool_config *cfg)
+/* Create a new pool.  On error, a message is emitted and NULL is
+ * returned.  */
+{
+  struct pool *pool;
+  long  slots = cfg->slots;
+  unsigned long long  memory = cfg->memory;
+
+  if (slots <= 0)
+    slots = sysconf(_SC_NPROCESSORS_CONF);
+  if (memory == 0)
+    memory = (unsigned long long)sysconf(_SC_PHYS_PAGES)
+      * sysconf(_SC_PAGESIZE);
+
+  pool = xnew(struct pool, 1);
+  memset(pool, 0, sizeof(struct pool));
+  pool->backend = &process_backend;
+  pool->backend_data = pool;
+  pool->slots = slots;
+  pool->verbosity = cfg->verbosity;
+  pool->own_children = cfg->own_children;
+  pool->counters = cfg->counters;
+  pool->speculate = cfg->speculate;
+  pool->spawners = cfg->spawners < MAX_SPAWNERS ? cfg->spawners : MAX_SPAWNERS;
+#if ! defined(HAVE_PTHREAD) || ! defined(HAVE_POSIX_SPAWN)
+  pool->spawners = 0;
+#endif
+  /* counters need fork(), which would serialise the threads anyway */
+  if (pool->counters)
+    pool->spawners = 0;
+  pool->halt.mode = halt_NEVER;
+  pool->pressure.kind = pressure_NONE;
+  pool->next_id = 1;
+  pool->wake_fd[0] = pool->wake_fd[1] = -1;
+  pool->control_fd[0] = pool->control_fd[1] = -1;
+  pool->heartbeat_fd[0] = pool->heartbeat_fd[1] = -1;
+  pool->epoll_fd = -1;
+  pool->source_fd = -1;
+  pool->dumps_seen = n_dump_requests;
+  pool->drains_seen = n_drain_requests;
+
+  if (cfg->halt && parse_halt(cfg->halt, &pool->halt) < 0) {
+    error("error: invalid halt policy \"%s\"", cfg->halt);
+    goto fail;
+  }
+  if (cfg->suspend && parse_pressure_policy(cfg->suspend,
+					     &pool->pressure) < 0) {
+    error("error: invalid suspend policy \"%s\"", cfg->suspend);
+    goto fail;
+  }
+  priority_init(&pool->prio);
+  pool->prio.nice = cfg->nice;
+  get_priority(&pool->parent_prio);
+  if (cfg->sched && parse_sched_policy(cfg->sched, &pool->prio.policy) < 0) {
+    error("error: invalid scheduling policy \"%s\"", cfg->sched);
+    goto fail;
+  }
+  if (cfg->ionice && parse_ioprio(cfg->ionice, &pool->prio.ioprio) < 0) {
+    error("error: invalid I/O priority \"%s\"", cfg->ionice);
+    goto fail;
+  }
+  if (cfg->heartbeat && parse_heartbeat_policy(cfg->heartbeat,
+					       &pool->heartbeat) < 0) {
+    error("error: invalid heartbeat policy \"%s\"", cfg->heartbeat);
+    goto fail;
+  }
+  if (cfg->speculate > 0 && cfg->cache_dir) {
+    error("error: speculation cannot be used with a cache");
+    goto fail;
+  }
+  if (cfg->results_dir && cfg->archive) {
+    error("error: a results directory and an archive cannot be used"
+	  " together");
+    goto fail;
+  }
+  if (cfg->jobserver && strcmp(cfg->jobserver, "pipe") != 0
+      && strcmp(cfg->jobserver, "fifo") != 0
+      && strcmp(cfg->jobserver, "none") != 0) {
+    error("error: invalid jobserver style \"%s\"", cfg->jobserver);
+    goto fail;
+  }
+
+  if (pool->counters) {
+    int  n = counters_init();
+    if (n < 0) {
+      warning("warning: performance counters are not available (%m)");
+      pool->counters = 0;
+    } else if (pool->verbosity >= 2) {
+      char  names[256];
+      size_t  len = 0;
+      int  i;
+      for (i=0; i<n && len<sizeof(names); ++i)
+	len += snprintf(names+len, sizeof(names)-len, "%s%s",
+			i>0 ? ", " : "", counter_name(i));
+      message("performance counters: %s", names);
+    }
+  }
+
+  if (cfg->cache_dir) {
+    pool->cache = open_cache(cfg->cache_dir, cfg->cache_size);
+    if (! pool->cache) {
+      error("error: cannot open cache directory \"%s\" (%m)",
+	    cfg->cache_dir);
+      goto fail;
+    }
+  }
+  if (cfg->heartbeat) {
+    char  num[32];
+    if (open_heartbeat(pool->heartbeat_fd) < 0) {
+      error("error: cannot create heartbeat channel (%m)");
+      goto fail;
+    }
+    snprintf(num, sizeof(num), "%d", pool->heartbeat_fd[1]);
+    setenv("PARALLEL_HEARTBEAT_FD", num, 1);
+  }
+  if (cfg->archive) {
+    pool->archive = open_archive(cfg->archive, cfg->archive_compress);
+    if (! pool->archive)
+      goto fail;
+  }
+  if (cfg->results_dir) {
+    pool->results = open_results(cfg->results_dir);
+    if (! pool->results) {
+      error("error: cannot create result directory \"%s\" (%m)",
+	    cfg->results_dir);
+      goto fail;
+    }
+  }
+
+  if (cfg->jobserver && strcmp(cfg->jobserver, "none") == 0) {
+    /* do not use the jobserver of a parent make either */
+  } else if ((pool->js = jobserver_from_env())) {
+    if (pool->verbosity >= 2)
+      message("using the jobserver of the parent make");
+  } else if (cfg->jobserver) {
+    pool->js = new_jobserver(slots, strcmp(cfg->jobserver, "fifo") == 0);
+    if (! pool->js) {
+      error("error: cannot create jobserver (%m)");
+      goto fail;
+    }
+  }
+
+  if (cfg->control && open_control(pool, cfg->control) < 0) {
+    error("error: cannot open control FIFO \"%s\" (%m)", cfg->control);
+    goto fail;
+  }
+
+#ifdef USE_PIDFD
+  /* without pidfds, 'process_reap' falls back to waitid() */
+  if (! pool->own_children)
+    pool->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+#endif
+  if (pipe(pool->wake_fd) < 0) {
+    error("error: cannot create pipe (%m)");
+    goto fail;
+  }
+  fcntl(pool->wake_fd[0], F_SETFL, O_NONBLOCK);
+  fcntl(pool->wake_fd[1], F_SETFL, O_NONBLOCK);
+  fcntl(pool->wake_fd[0], F_SETFD, FD_CLOEXEC);
+  fcntl(pool->wake_fd[1], F_SETFD, FD_CLOEXEC);
+  if (add_wake_fd(pool->wake_fd[1]) < 0) {
+    error("error: too many pools (at most %d)", MAX_POOLS);
+    goto fail;
+  }
+  setup_signals(cfg->handle_signals);
+
+  pool->sched = new_sched(slots, memory, cfg->lookahead > 0
+			  ? cfg->lookahead : 100);
+  if (pool->speculate > 0)
+    pool->runtimes = xnew(double, SPECULATE_SAMPLES);
+  return pool;
+
+ fail:
+  if (pool->epoll_fd >= 0)
+    close(pool->epoll_fd);
+  if (pool->wake_fd[0] >= 0) {
+    close(pool->wake_fd[0]);
+    close(pool->wake_fd[1]);
+  }
+  close_control(pool);
+  close_heartbeat(pool);
+  if (pool->js)
+    delete_jobserver(pool->js);
+  if (pool->results)
+    close_results(pool->results);
+  if (pool->archive)
+    close_archive(pool->archive);
+  if (pool->cache)
+    close_cache(pool->cache);
+  xfree(pool);
+  return NULL;
+}
+
+void
+delete_pool(struct pool *pool)
+/* Terminate all jobs which are still running, and free the pool.  */
+{
+  struct job *job;
+
+  if (pool->running || sched_pending(pool->sched) > 0) {
+    halt_pool(pool);
+    for (job = pool->running; job; job = job->next)
+      terminate_job(pool, job, pool_now(pool));
+    pool_wait(pool);
+  }
+  /* only left over if waiting failed */
+  while ((job = pool->running)) {
+    pool->running = job->next;
+    delete_job(job);
+  }
+  if (pool->epoll_fd >= 0)
+    close(pool->epoll_fd);
+
+  remove_wake_fd(pool->wake_fd[1]);
+  close(pool->wake_fd[0]);
+  close(pool->wake_fd[1]);
+  close_control(pool);
+  close_heartbeat(pool);
+  if (pool->js)
+    delete_jobserver(pool->js);
+  delete_sched(pool->sched);
+  xfree(pool->by_pid);
+  xfree(pool->runtimes);
+  if (pool->results)
+    close_results(pool->results);
+  if (pool->archive)
+    close_archive(pool->archive);
+  if (pool->cache)
+    close_cache(pool->cache);
+  xfree(pool);
+}
+
+void
+pool_set_backend(struct pool *pool, const struct backend *backend,
+		 void *client_data)
+/* Run the jobs of POOL using BACKEND instead of child processes.  This
+ * must be called before any job is started.  */
+{
+  assert(! pool->running);
+  pool->backend = backend;
+  pool->backend_data = client_data;
+  /* other backends need not be thread-safe */
+  pool->spawners = 0;
+}
+
+double
+pool_now(const struct pool *pool)
+/* Return the current time of the backend, in seconds.  */
+{
+  return pool->backend->now(pool->backend_data);
+}
+
+void
+pool_set_callback(struct pool *pool, pool_callback fn, void *client_data)
+/* Arrange for FN to be called whenever a job has finished.  */
+{
+  pool->callback = fn;
+  pool->callback_data = client_data;
+}
+
+void
+pool_set_source(struct pool *pool, job_source_fn fn, void *client_data)
+/* Arrange for FN to be called whenever the pool could start more
+ * jobs.  FN returns a new job, or NULL if it has no job to add at the
+ * moment; it sets *EOF_P once there are no more jobs.  Use
+ * 'pool_wants_more' to avoid reading too far ahead.  */
+{
+  pool->source = fn;
+  pool->source_data = client_data;
+  pool->source_fd = -1;
+}
+
+void
+pool_watch_source(struct pool *pool, int fd)
+/* Tell the pool that the job source may have no job ready for a while,
+ * even if the pool is idle, and that FD becomes readable once it has
+ * one.  The source must drain FD.  */
+{
+  pool->source_fd = fd;
+}
+
+int
+pool_wants_more(struct pool *pool, const char *queue)
+/* Return true, if the look-ahead window of QUEUE has room for more
+ * jobs.  */
+{
+  return sched_wants_more(pool->sched, queue);
+}
+
+void
+pool_add_queue(struct pool *pool, const char *name, long max, long weight)
+/* Create the queue NAME, or change its settings.  At most MAX cpus (0
+ * for no limit) are used by the jobs of this queue.  When several
+ * queues have jobs waiting, the cpus are shared in proportion to the
+ * weights.  */
+{
+  sched_add_queue(pool->sched, name, max, weight > 0 ? weight : 1);
+}
+
+void
+pool_set_order(struct pool *pool, enum sched_order order)
+{
+  sched_set_order(pool->sched, order);
+}
+
+void
+pool_add_job(struct pool *pool, struct job *job)
+/* Append JOB to the queue of pending jobs.  The pool takes ownership
+ * of JOB.  */
+{
+  if (job->cmd_no >= pool->next_id)
+    pool->next_id = job->cmd_no + 1;
+  if (pool->stats.halted) {
+    drop_job(pool, job);
+    return;
+  }
+  sched_add(pool->sched, job);
+  ++pool->stats.submitted;
+  ++pool->stats.pending;
+}
+
+long
+pool_submit(struct pool *pool, const char *cmd)
+/* Submit the shell command CMD, to be run by /bin/sh.  Return the ID
+ * of the new job.  */
+{
+  return pool_submit_to(pool, NULL, cmd);
+}
+
+long
+pool_submit_to(struct pool *pool, const char *queue, const char *cmd)
+/* Like 'pool_submit', but add the job to the given queue.  */
+{
+  struct job *job = new_job(pool->next_id, cmd);
+
+  if (queue)
+    job->queue_name = xstrdup(queue);
+  pool_add_job(pool, job);
+  return job->cmd_no;
+}
+
+static int
+needs_quotes(const char *arg)
+{
+  if (! *arg)
+    return 1;
+  for (; *arg; ++arg) {
+    if (! (isalnum((unsigned char)*arg) || strchr("-_./=:,+@%", *arg)))
+      return 1;
+  }
+  return 0;
+}
+
+long
+pool_submit_argv(struct pool *pool, char *const argv[])
+/* Submit a command given as a NULL-terminated argument vector.  The
+ * command is run directly, without using a shell.  Return the ID of
+ * the new job.  */
+{
+  struct job *job;
+  char *cmd, *ptr;
+  size_t  len = 1;
+  int  argc, i;
+
+  assert(argv[0]);
+  for (argc=0; argv[argc]; ++argc)
+    len += 4 * strlen(argv[argc]) + 3;
+
+  /* for messages and cache keys, quote the arguments like the shell */
+  cmd = ptr = xnew(char, len);
+  for (i=0; i<argc; ++i) {
+    const char *arg = argv[i];
+    if (i > 0)
+      *ptr++ = ' ';
+    if (! needs_quotes(arg)) {
+      strcpy(ptr, arg);
+      ptr += strlen(arg);
+      continue;
+    }
+    *ptr++ = '\'';
+    for (; *arg; ++arg) {
+      if (*arg == '\'') {
+	memcpy(ptr, "'\\''", 4);
+	ptr += 4;
+      } else {
+	*ptr++ = *arg;
+      }
+    }
+    *ptr++ = '\'';
+  }
+  *ptr = '\0';
+
+  job = new_job(pool->next_id, cmd);
+  xfree(cmd);
+  job->argv = xnew(char *, argc+1);
+  for (i=0; i<argc; ++i)
+    job->argv[i] = xstrdup(argv[i]);
+  job->argv[argc] = NULL;
+
+  pool_add_job(pool, job);
+  return job->cmd_no;
+}
+
+int
+pool_cancel(struct pool *pool, long id)
+/* Cancel the job with the given ID.  A pending job is removed from the
+ * queue, a running job is sent SIGTERM.  Return 0 on success and -1
+ * if no such job exists.  */
+{
+  struct job *job;
+  int  found = 0;
+
+  job = sched_remove(pool->sched, id);
+  if (job) {
+    --pool->stats.pending;
+    drop_job(pool, job);
+    return 0;
+  }
+  /* a speculated job runs twice */
+  for (job = pool->running; job; job = job->next) {
+    if (job->cmd_no == id) {
+      terminate_job(pool, job, pool_now(pool));
+      found = 1;
+    }
+  }
+  return found ? 0 : -1;
+}
+
+void
+pool_set_slots(struct pool *pool, long slots)
+/* Change the number of cpu slots.  If the running jobs use more cpus,
+ * they are allowed to finish, but no new jobs start until enough
+ * slots are free.  */
+{
+  if (slots <= 0)
+    slots = sysconf(_SC_NPROCESSORS_CONF);
+  pool->slots = slots;
+  sched_set_cpus(pool->sched, slots);
+  if (pool->verbosity >= 1)
+    message("using %ld slots", slots);
+}
+
+void
+pool_hold(struct pool *pool, int hold)
+/* Stop starting new jobs if HOLD is set, and resume otherwise.  Running
+ * jobs are not affected.  */
+{
+  if (pool->stats.on_hold == (hold != 0))
+    return;
+  pool->stats.on_hold = (hold != 0);
+  if (pool->verbosity >= 1)
+    message(hold ? "not starting new jobs" : "starting new jobs again");
+}
+
+void
+pool_drain(struct pool *pool)
+/* Let the running jobs finish, but discard all jobs which have not been
+ * started yet.  */
+{
+  if (pool->stats.halted)
+    return;
+  if (pool->verbosity >= 1)
+    message("draining: waiting for %ld running jobs, dropping the rest",
+	    pool->stats.running);
+  if (pool->halt.mode == halt_NOW)
+    pool->halt.mode = halt_SOON;
+  halt_pool(pool);
+}
+
+void
+pool_dump(const struct pool *pool)
+/* Emit one message for every running job.  */
+{
+  const struct job *job;
+  double  now = pool_now(pool);
+  double  eta = estimate_eta(pool, now);
+  char  eta_msg[64], done_msg[32], beat_msg[48];
+
+  eta_msg[0] = '\0';
+  if (eta >= 0 && pool->running)
+    snprintf(eta_msg, sizeof(eta_msg), ", about %.0f seconds left", eta);
+  message("%ld of %ld slots used, %ld pending, %ld running, %ld done,"
+	  " %ld failed%s%s", sched_cpus_used(pool->sched), pool->slots,
+	  pool->stats.pending, pool->stats.running, pool->stats.done,
+	  pool->stats.failed, eta_msg, pool->stats.halted ? " (draining)"
+	  : pool->stats.on_hold ? " (on hold)" : "");
+  for (job = pool->running; job; job = job->next) {
+    done_msg[0] = beat_msg[0] = '\0';
+    if (job->progress >= 0)
+      snprintf(done_msg, sizeof(done_msg), ", %.0f%% done",
+	       100 * job->progress);
+    if (pool->heartbeat_fd[0] >= 0 && ! job->paused)
+      snprintf(beat_msg, sizeof(beat_msg), ", silent for %.1f seconds",
+	       now - job->last_beat);
+    message("%ld: pid %d, %.1f seconds, %ld cpus%s%s%s%s%s: %s",
+	    job->cmd_no, (int)job->pid, now - job->start_time, job->cpus,
+	    done_msg, beat_msg, job->paused ? ", suspended" : "",
+	    job->backup ? ", second copy" : "",
+	    job->kill_time > 0 ? ", terminating" : "", job->cmd);
+  }
+}
+
+int
+pool_control(struct pool *pool, const char *cmd)
+/* Execute one command of the control FIFO: "slots N", "pause",
+ * "resume", "drain" or "dump".  Return 0 on success and -1 if CMD is
+ * invalid.  */
+{
+  if (strncmp(cmd, "slots ", 6) == 0) {
+    char *tail;
+    long  n;
+    errno = 0;
+    n = strtol(cmd+6, &tail, 10);
+    if (tail == cmd+6 || *tail || errno || n < 1)
+      return -1;
+    pool_set_slots(pool, n);
+  } else if (strcmp(cmd, "pause") == 0) {
+    pool_hold(pool, 1);
+  } else if (strcmp(cmd, "resume") == 0) {
+    pool_hold(pool, 0);
+  } else if (strcmp(cmd, "drain") == 0) {
+    pool_drain(pool);
+  } else if (strcmp(cmd, "dump") == 0) {
+    pool_dump(pool);
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int
+pool_fd(const struct pool *pool)
+/* Return a file descriptor which becomes readable whenever the pool
+ * needs attention.  This does not cover the control FIFO; a program
+ * with its own event loop can call 'pool_control' instead.  Neither
+ * does it cover the heartbeat channel; such a program must call
+ * 'pool_run' at least once per heartbeat interval.  */
+{
+  return pool->wake_fd[0];
+}
+
+long
+pool_run(struct pool *pool, double timeout)
+/* Start pending jobs and collect the finished ones.  If nothing
+ * happened, wait for up to TIMEOUT seconds (indefinitely, if TIMEOUT
+ * is negative) for a job to finish, and process it.  Return the number
+ * of pending and running jobs, plus one if the job source may provide
+ * more jobs.  If the finished jobs cannot be collected, return -1 with
+ * errno set; the pool can then only be deleted.  */
+{
+  double  now, next;
+  int  reaped, i;
+
+  for (i=0; i<2 && ! pool->wait_errno; ++i) {
+    if (pool->backend == &process_backend)
+      drain_wake_fd(pool);
+    if (pool->control_fd[0] >= 0)
+      read_control(pool);
+    if (pool->heartbeat.timeout > 0 && pool->heartbeat_fd[0] >= 0)
+      read_heartbeats(pool, pool_now(pool));
+    if (pool->dumps_seen != n_dump_requests) {
+      pool->dumps_seen = n_dump_requests;
+      pool_dump(pool);
+    }
+    if (pool->drains_seen != n_drain_requests) {
+      pool->drains_seen = n_drain_requests;
+      pool_drain(pool);
+    }
+    dispatch(pool);
+    reaped = reap(pool);
+
+    now = pool_now(pool);
+    if (interrupted && ! pool->stats.signal) {
+      pool->stats.signal = interrupted;
+      halt_pool(pool);
+    }
+    if ((pool->stats.signal || (pool->stats.halted
+				&& pool->halt.mode == halt_NOW))
+	&& pool->running) {
+      struct job *job;
+      for (job = pool->running; job; job = job->next)
+	terminate_job(pool, job, now);
+    }
+    next = kill_stragglers(pool, now);
+    if (pool->pressure.kind != pressure_NONE && ! pool->stats.halted
+	&& pool->running) {
+      double  t = check_pressure(pool, now);
+      if (next < 0 || t < next)
+	next = t;
+    }
+    if (pool->speculate > 0) {
+      double  t = speculate(pool, now);
+      if (t >= 0 && (next < 0 || t < next))
+	next = t;
+    }
+    if (pool->heartbeat.timeout > 0 && pool->heartbeat_fd[0] >= 0) {
+      double  t = check_heartbeats(pool, now);
+      if (t >= 0 && (next < 0 || t < next))
+	next = t;
+    }
+    if (pool->archive) {
+      double  t = archive_tick(pool->archive, now);
+      if (t >= 0 && (next < 0 || t < next))
+	next = t;
+    }
+
+    /* while on hold, wait for the control FIFO even if idle, and
+     * wait for a slow job source */
+    if (reaped || (! pool->running
+		   && (! pool->stats.on_hold || pool->stats.halted)
+		   && (! pool->source || pool->source_fd < 0))
+	|| timeout == 0 || i > 0)
+      break;
+
+    if (timeout > 0 && (next < 0 || timeout < next))
+      next = timeout;
+    pool->backend->wait(next,
+			(pool->js && ! pool->stats.halted
+			 && ! pool->stats.on_hold
+			 && (sched_demand(pool->sched)
+			     > 1 + jobserver_held(pool->js)))
+			? jobserver_fd(pool->js) : -1,
+			pool->backend_data);
+  }
+  if (pool->wait_errno) {
+    errno = pool->wait_errno;
+    return -1;
+  }
+  return (pool->stats.pending + pool->stats.running
+	  + (pool->source ? 1 : 0));
+}
+
+int
+pool_wait(struct pool *pool)
+/* Run jobs until all submitted jobs have finished.  Return 0 on
+ * success and -1, with errno set, if 'pool_run' failed.  */
+{
+  long  n;
+
+  while ((n = pool_run(pool, -1)) > 0)
+    ;
+  return n < 0 ? -1 : 0;
+}
+
+void
+pool_stats(const struct pool *pool, struct pool_stats *st)
+{
+  *st = pool->stats;
+  st->eta = estimate_eta(pool, pool_now(pool));
+}
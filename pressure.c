@@ -0,0 +1,102 @@
+/* pressure.c - measure how busy the machine is
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "parallel.h"
+
+
+int
+parse_pressure_policy(const char *arg, struct pressure_policy *policy)
+/* Parse a policy of the form "load=L[,resume=R]" or
+ * "pressure=P[,resume=R]".  If no resume threshold is given, jobs are
+ * resumed once the measurement falls below 3/4 of the threshold.  The
+ * resume threshold must be below the suspend threshold.  Return 0 on
+ * success and -1 on error.  */
+{
+  char *tail;
+  const char *ptr;
+
+  if (strncmp(arg, "load=", 5) == 0) {
+    policy->kind = pressure_LOAD;
+    policy->window = 60;
+    ptr = arg+5;
+  } else if (strncmp(arg, "pressure=", 9) == 0) {
+    policy->kind = pressure_CPU;
+    policy->window = 10;
+    ptr = arg+9;
+  } else {
+    return -1;
+  }
+
+  policy->high = strtod(ptr, &tail);
+  if (tail == ptr || policy->high <= 0)
+    return -1;
+  policy->low = 0.75 * policy->high;
+  if (strncmp(tail, ",resume=", 8) == 0) {
+    ptr = tail+8;
+    policy->low = strtod(ptr, &tail);
+    if (tail == ptr || policy->low < 0 || policy->low >= policy->high)
+      return -1;
+  }
+  if (*tail != '\0')
+    return -1;
+
+  if (policy->kind == pressure_CPU && read_pressure(policy, NULL) < 0) {
+    warning("warning: /proc/pressure/cpu not available,"
+	    " using the load average");
+    policy->kind = pressure_LOAD;
+    policy->window = 60;
+  }
+  return 0;
+}
+
+int
+read_pressure(const struct pressure_policy *policy, double *value_p)
+/* Measure the current load of the machine, as selected by POLICY:
+ * either the 1-minute load average, or the percentage of time during
+ * the last 10 seconds in which runnable tasks were waiting for a cpu.
+ * 'policy->window' gives the averaging period.
+ * Return 0 on success and -1 on error.  */
+{
+  double  value;
+
+  if (policy->kind == pressure_LOAD) {
+    if (getloadavg(&value, 1) != 1)
+      return -1;
+  } else {
+    FILE *f = fopen("/proc/pressure/cpu", "r");
+    int  n;
+
+    if (! f)
+      return -1;
+    n = fscanf(f, "some avg10=%lf", &value);
+    fclose(f);
+    if (n != 1)
+      return -1;
+  }
+  if (value_p)
+    *value_p = value;
+  return 0;
+}
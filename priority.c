@@ -0,0 +1,214 @@
+/* priority.c - scheduling hints for the jobs
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Every job runs with a nice level, and optionally with a different
+ * scheduling policy and I/O priority.  The settings are applied to the
+ * process group of the job and are inherited by all its descendants.
+ * Settings which need privileges the user does not have are silently
+ * left unchanged.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "parallel.h"
+
+
+/* see linux/ioprio.h, which is not installed everywhere */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_WHO_PGRP 2
+
+
+void
+priority_init(struct priority *prio)
+/* Mark all settings in PRIO as unset.  */
+{
+  prio->nice = PRIORITY_UNSET;
+  prio->policy = PRIORITY_UNSET;
+  prio->ioprio = PRIORITY_UNSET;
+}
+
+int
+parse_nice(const char *arg, int *nice_p)
+/* Parse a nice level between -20 and 19.  Return 0 on success and -1
+ * on error.  */
+{
+  char *tail;
+  long  nice;
+
+  errno = 0;
+  nice = strtol(arg, &tail, 10);
+  if (tail == arg || *tail != '\0' || errno || nice < -20 || nice > 19)
+    return -1;
+  *nice_p = nice;
+  return 0;
+}
+
+int
+parse_sched_policy(const char *arg, int *policy_p)
+/* Parse a scheduling policy, one of "other", "batch" or "idle".
+ * Return 0 on success and -1 on error.  */
+{
+  if (strcmp(arg, "other") == 0) {
+    *policy_p = SCHED_OTHER;
+#ifdef SCHED_BATCH
+  } else if (strcmp(arg, "batch") == 0) {
+    *policy_p = SCHED_BATCH;
+#endif
+#ifdef SCHED_IDLE
+  } else if (strcmp(arg, "idle") == 0) {
+    *policy_p = SCHED_IDLE;
+#endif
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int
+parse_ioprio(const char *arg, int *ioprio_p)
+/* Parse an I/O priority of the form "idle", "be[:LEVEL]" or
+ * "rt[:LEVEL]", where LEVEL is between 0 (highest) and 7 (lowest,
+ * default 4).  Return 0 on success and -1 on error.  */
+{
+  const char *colon;
+  size_t  len;
+  char *tail;
+  long  level = 4;
+  int  class;
+
+  colon = strchr(arg, ':');
+  len = colon ? (size_t)(colon - arg) : strlen(arg);
+  if (len == 4 && strncmp(arg, "idle", 4) == 0 && ! colon) {
+    class = IOPRIO_CLASS_IDLE;
+    level = 0;
+  } else if (len == 2 && strncmp(arg, "be", 2) == 0) {
+    class = IOPRIO_CLASS_BE;
+  } else if (len == 2 && strncmp(arg, "rt", 2) == 0) {
+    class = IOPRIO_CLASS_RT;
+  } else {
+    return -1;
+  }
+  if (colon) {
+    errno = 0;
+    level = strtol(colon+1, &tail, 10);
+    if (tail == colon+1 || *tail != '\0' || errno || level < 0 || level > 7)
+      return -1;
+  }
+  *ioprio_p = (class << IOPRIO_CLASS_SHIFT) | level;
+  return 0;
+}
+
+void
+priority_merge(struct priority *res, const struct priority *prio,
+	       const struct priority *dflt)
+/* Store the settings of PRIO in RES, taking the settings which are
+ * unset in PRIO from DFLT.  */
+{
+  res->nice = prio->nice != PRIORITY_UNSET ? prio->nice : dflt->nice;
+  res->policy = prio->policy != PRIORITY_UNSET ? prio->policy : dflt->policy;
+  res->ioprio = prio->ioprio != PRIORITY_UNSET ? prio->ioprio : dflt->ioprio;
+}
+
+void
+get_priority(struct priority *prio)
+/* Store the nice level and the I/O priority of the calling thread in
+ * PRIO.  The scheduling policy is left unset.  */
+{
+  priority_init(prio);
+  errno = 0;
+  prio->nice = getpriority(PRIO_PROCESS, 0);
+  if (prio->nice == -1 && errno)
+    prio->nice = PRIORITY_UNSET;
+#ifdef SYS_ioprio_get
+  prio->ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+  if (prio->ioprio < 0)
+    prio->ioprio = PRIORITY_UNSET;
+#endif
+}
+
+int
+set_thread_priority(const struct priority *prio)
+/* Apply the nice level and the I/O priority of PRIO to the calling
+ * thread.  Linux keeps both per thread, and processes spawned by the
+ * thread inherit them.  Return 0 on success and -1 if a setting could
+ * not be applied, e.g. because the nice level would have to be
+ * lowered.  */
+{
+  pid_t  tid = syscall(SYS_gettid);
+
+  if (prio->nice != PRIORITY_UNSET
+      && setpriority(PRIO_PROCESS, tid, prio->nice) < 0)
+    return -1;
+  if (prio->ioprio != PRIORITY_UNSET) {
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, tid) != prio->ioprio
+	&& syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, prio->ioprio) < 0)
+      return -1;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+  }
+  return 0;
+}
+
+int
+set_priority(pid_t pgrp, const struct priority *prio)
+/* Apply the settings of PRIO to the process group PGRP, or to the
+ * process group of the caller if PGRP is 0.  Unset settings are left
+ * alone.  The scheduling policy can only be set per process and is
+ * applied to the group leader.  This is safe to call between fork()
+ * and exec().  Return 0 on success and -1 if any of the settings could
+ * not be applied.  */
+{
+  int  rc = 0;
+
+  /* the policy first, since it may reset the nice level */
+  if (prio->policy != PRIORITY_UNSET) {
+    struct sched_param  param;
+    memset(&param, 0, sizeof(param));
+    if (sched_setscheduler(pgrp, prio->policy, &param) < 0)
+      rc = -1;
+  }
+  if (prio->nice != PRIORITY_UNSET
+      && setpriority(PRIO_PGRP, pgrp, prio->nice) < 0)
+    rc = -1;
+  if (prio->ioprio != PRIORITY_UNSET) {
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PGRP, pgrp, prio->ioprio) < 0)
+      rc = -1;
+#else
+    errno = ENOSYS;
+    rc = -1;
+#endif
+  }
+  return rc;
+}
@@ -0,0 +1,180 @@
+/* results.c - store the output of every job in a separate directory
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* For command number N, the files DIR/N/stdout, DIR/N/stderr and
+ * DIR/N/status are created.  The output files are opened by parallel
+ * and inherited by the child, so that the output is written to disk
+ * without passing through parallel.  While the job runs, all files
+ * carry a ".tmp" suffix; they are renamed once the job has finished,
+ * so that the presence of DIR/N/status signals a complete result.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "parallel.h"
+
+
+struct results {
+  char *dir;
+};
+
+static const char *output_names[] = { "stdout", "stderr" };
+
+
+struct results *
+open_results(const char *dir)
+{
+  struct results *r;
+
+  if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+    return NULL;
+
+  r = xnew(struct results, 1);
+  r->dir = xstrdup(dir);
+  return r;
+}
+
+void
+close_results(struct results *r)
+{
+  xfree(r->dir);
+  xfree(r);
+}
+
+int
+results_prepare(struct results *r, struct job *job)
+/* Create the result directory for JOB and open the temporary output
+ * files.  Return 0 on success and -1 on error.  */
+{
+  char *path;
+  int  fd[2], i;
+
+  asprintf(&path, "%s/%ld", r->dir, job->cmd_no);
+  if (mkdir(path, 0777) < 0 && errno != EEXIST) {
+    error("error: cannot create \"%s\" (%m)", path);
+    free(path);
+    return -1;
+  }
+  free(path);
+
+  for (i=0; i<2; ++i) {
+    asprintf(&path, "%s/%ld/%s.tmp", r->dir, job->cmd_no, output_names[i]);
+    fd[i] = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+    if (fd[i] < 0) {
+      error("error: cannot create \"%s\" (%m)", path);
+      free(path);
+      if (i > 0)
+	close(fd[0]);
+      return -1;
+    }
+    free(path);
+  }
+  job->result_out = fd[0];
+  job->result_err = fd[1];
+  return 0;
+}
+
+static int
+results_rename(struct results *r, long cmd_no, const char *name)
+{
+  char *from, *to;
+  int  rc;
+
+  asprintf(&from, "%s/%ld/%s.tmp", r->dir, cmd_no, name);
+  asprintf(&to, "%s/%ld/%s", r->dir, cmd_no, name);
+  rc = rename(from, to);
+  if (rc < 0)
+    error("error: cannot rename \"%s\" (%m)", from);
+  free(to);
+  free(from);
+  return rc;
+}
+
+void
+write_status(FILE *f, const struct job *job, int status, int cached)
+/* Write the "name: value" lines describing the run of JOB to F.  */
+{
+  int  i;
+
+  fprintf(f, "command: %s\n", job->cmd);
+  if (job->pid > 0)
+    fprintf(f, "pid: %d\n", (int)job->pid);
+  if (cached)
+    fputs("cached: yes\n", f);
+  if (WIFEXITED(status))
+    fprintf(f, "exit: %d\n", WEXITSTATUS(status));
+  else if (WIFSIGNALED(status))
+    fprintf(f, "signal: %d\n", WTERMSIG(status));
+  if (job->start_time > 0) {
+    fprintf(f, "start: %.3f\n", job->start_wall);
+    fprintf(f, "runtime: %.3f\n", job->end_time - job->start_time);
+  }
+  if (job->paused_time > 0)
+    fprintf(f, "paused: %.3f\n", job->paused_time);
+  for (i=0; i<job->n_counters; ++i)
+    fprintf(f, "%s: %llu\n", counter_name(i), job->counter[i]);
+  if (job->no_counters)
+    fputs("counters: unavailable\n", f);
+}
+
+void
+results_finish(struct results *r, struct job *job, int status, int cached)
+/* Write the status file of JOB and move its output files into place.
+ * STATUS is the wait status of the job.  */
+{
+  char *path;
+  FILE *f;
+  int  i;
+
+  if (job->result_out >= 0) {
+    close(job->result_out);
+    job->result_out = -1;
+  }
+  if (job->result_err >= 0) {
+    close(job->result_err);
+    job->result_err = -1;
+  }
+
+  asprintf(&path, "%s/%ld/status.tmp", r->dir, job->cmd_no);
+  f = fopen(path, "w");
+  free(path);
+  if (! f) {
+    error("error: cannot write status of command %ld (%m)", job->cmd_no);
+    return;
+  }
+  write_status(f, job, status, cached);
+  if (fclose(f) != 0) {
+    error("error: cannot write status of command %ld (%m)", job->cmd_no);
+    return;
+  }
+
+  for (i=0; i<2; ++i)
+    results_rename(r, job->cmd_no, output_names[i]);
+  results_rename(r, job->cmd_no, "status");
+}
@@ -0,0 +1,514 @@
+/* sched.c - decide which of the pending jobs to start next
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+
+#include "parallel.h"
+
+
+/* Every job belongs to a queue.  A queue may limit the number of cpus
+ * its jobs use at a time, and when several queues compete for free
+ * cpus, each gets a share proportional to its weight.  Queue 0 is the
+ * default queue, which has no limit of its own.  */
+struct queue {
+  char *name;
+  long  max;			/* cpus this queue may use, or 0 */
+  long  weight;
+  long  cpus_used;
+  struct job *head, **tail;
+  long  n_pending;
+};
+
+struct sched {
+  long  cpus_total, cpus_used;
+  long  cpus_limit;		/* temporary limit, e.g. from a jobserver */
+  unsigned long long  mem_total, mem_used;
+  long  lookahead;
+  enum sched_order  order;
+  struct queue **queues;
+  int  n_queues;
+  long  n_pending;
+};
+
+
+struct job *
+new_job(long cmd_no, const char *cmd)
+{
+  struct job *job;
+  int  i;
+
+  job = xnew(struct job, 1);
+  job->next = job->prev = NULL;
+  job->cmd_no = cmd_no;
+  job->cmd = xstrdup(cmd);
+  job->argv = NULL;
+  job->queue_name = NULL;
+  job->queue = 0;
+  job->cpus = 1;
+  job->mem = 0;
+  job->duration = 0;
+  priority_init(&job->prio);
+  job->passed = 0;
+  job->inputs = NULL;
+  job->n_inputs = 0;
+  job->cache_key = NULL;
+  job->cache_tmp = NULL;
+  job->in_fd = -1;
+  job->out_fd = job->err_fd = -1;
+  job->result_out = job->result_err = -1;
+  job->spec_out = job->spec_err = -1;
+  job->pid = -1;
+  job->pidfd = -1;
+  job->start_time = job->end_time = 0;
+  job->start_wall = 0;
+  job->paused = 0;
+  job->pause_start = job->paused_time = 0;
+  job->kill_time = 0;
+  job->last_beat = 0;
+  job->progress = -1;
+  job->stalled = job->attempts = 0;
+  job->twin = NULL;
+  job->backup = job->lost = 0;
+  for (i=0; i<MAX_COUNTERS; ++i) {
+    job->counter_fd[i] = -1;
+    job->counter[i] = 0;
+  }
+  job->n_counters = 0;
+  job->no_counters = 0;
+  return job;
+}
+
+struct job *
+copy_job(const struct job *job)
+/* Return a new job which runs the same command as JOB, with the same
+ * annotations.  */
+{
+  struct job *copy;
+  int  i;
+
+  copy = new_job(job->cmd_no, job->cmd);
+  if (job->argv) {
+    for (i=0; job->argv[i]; ++i)
+      ;
+    copy->argv = xnew(char *, i+1);
+    for (i=0; job->argv[i]; ++i)
+      copy->argv[i] = xstrdup(job->argv[i]);
+    copy->argv[i] = NULL;
+  }
+  if (job->queue_name)
+    copy->queue_name = xstrdup(job->queue_name);
+  copy->cpus = job->cpus;
+  copy->mem = job->mem;
+  copy->duration = job->duration;
+  copy->prio = job->prio;
+  if (job->n_inputs > 0) {
+    copy->inputs = xnew(char *, job->n_inputs);
+    for (i=0; i<job->n_inputs; ++i)
+      copy->inputs[i] = xstrdup(job->inputs[i]);
+    copy->n_inputs = job->n_inputs;
+  }
+  return copy;
+}
+
+int
+job_output_fd(const struct job *job, int fd)
+/* Return the file descriptor which receives the output the job writes
+ * to FD (1 or 2), once it has been captured.  */
+{
+  if (fd == 1 && job->result_out >= 0)
+    return job->result_out;
+  if (fd == 2 && job->result_err >= 0)
+    return job->result_err;
+  return fd;
+}
+
+void
+delete_job(struct job *job)
+{
+  int  i;
+
+  if (job->in_fd >= 0)  close(job->in_fd);
+  if (job->out_fd >= 0)  close(job->out_fd);
+  if (job->err_fd >= 0)  close(job->err_fd);
+  if (job->pidfd >= 0)  close(job->pidfd);
+  if (job->result_out >= 0)  close(job->result_out);
+  if (job->result_err >= 0)  close(job->result_err);
+  if (job->spec_out >= 0)  close(job->spec_out);
+  if (job->spec_err >= 0)  close(job->spec_err);
+  for (i=0; i<job->n_counters; ++i) {
+    if (job->counter_fd[i] >= 0)  close(job->counter_fd[i]);
+  }
+  for (i=0; i<job->n_inputs; ++i)
+    xfree(job->inputs[i]);
+  xfree(job->inputs);
+  xfree(job->cache_key);
+  xfree(job->cache_tmp);
+  if (job->argv) {
+    for (i=0; job->argv[i]; ++i)
+      xfree(job->argv[i]);
+    xfree(job->argv);
+  }
+  xfree(job->queue_name);
+  xfree(job->cmd);
+  xfree(job);
+}
+
+struct sched *
+new_sched(long cpus, unsigned long long mem, long lookahead)
+{
+  struct sched *s;
+
+  assert(cpus >= 1 && lookahead >= 1);
+
+  s = xnew(struct sched, 1);
+  s->cpus_total = cpus;
+  s->cpus_used = 0;
+  s->cpus_limit = cpus;
+  s->mem_total = mem;
+  s->mem_used = 0;
+  s->lookahead = lookahead;
+  s->order = order_FIFO;
+  s->queues = NULL;
+  s->n_queues = 0;
+  s->n_pending = 0;
+  sched_add_queue(s, "default", 0, 1);
+  return s;
+}
+
+void
+delete_sched(struct sched *s)
+{
+  struct job *job;
+  int  i;
+
+  assert(s->cpus_used == 0);
+  for (i=0; i<s->n_queues; ++i) {
+    struct queue *q = s->queues[i];
+    while ((job = q->head)) {
+      q->head = job->next;
+      delete_job(job);
+    }
+    xfree(q->name);
+    xfree(q);
+  }
+  xfree(s->queues);
+  xfree(s);
+}
+
+static int
+find_queue(struct sched *s, const char *name, int create)
+/* Return the index of the queue NAME, or -1 if there is no such queue
+ * and CREATE is not set.  New queues have no limit and weight 1.  */
+{
+  struct queue *q;
+  int  i;
+
+  for (i=0; i<s->n_queues; ++i) {
+    if (strcmp(s->queues[i]->name, name) == 0)
+      return i;
+  }
+  if (! create)
+    return -1;
+
+  q = xnew(struct queue, 1);
+  s->queues = xrenew(struct queue *, s->queues, s->n_queues+1);
+  s->queues[s->n_queues] = q;
+  q->name = xstrdup(name);
+  q->max = 0;
+  q->weight = 1;
+  q->cpus_used = 0;
+  q->head = NULL;
+  q->tail = &q->head;
+  q->n_pending = 0;
+  return s->n_queues++;
+}
+
+void
+sched_add_queue(struct sched *s, const char *name, long max, long weight)
+/* Set the limit MAX (0 for none) and the weight of the queue NAME,
+ * creating the queue if needed.  */
+{
+  struct queue *q;
+  int  i;
+
+  assert(max >= 0 && weight >= 1);
+  i = find_queue(s, name, 1);
+  q = s->queues[i];
+  q->max = max;
+  q->weight = weight;
+}
+
+int
+sched_wants_more(struct sched *s, const char *queue)
+/* Return true, if the look-ahead window of the given queue (or of the
+ * default queue, if QUEUE is NULL) is not yet full.  In total, at most
+ * 'lookahead' jobs per queue are kept.  */
+{
+  int  i = queue ? find_queue(s, queue, 0) : 0;
+
+  if (s->n_pending >= s->lookahead * s->n_queues)
+    return 0;
+  return i < 0 || s->queues[i]->n_pending < s->lookahead;
+}
+
+long
+sched_pending(const struct sched *s)
+{
+  return s->n_pending;
+}
+
+long
+sched_demand(const struct sched *s)
+/* Return the number of cpus needed to run all running and pending
+ * jobs at once, but at most the number of available cpus.  */
+{
+  const struct job *job;
+  long  demand = s->cpus_used;
+  int  i;
+
+  for (i=0; i<s->n_queues && demand < s->cpus_total; ++i) {
+    const struct queue *q = s->queues[i];
+    long  used = q->cpus_used;
+    for (job = q->head; job && demand < s->cpus_total; job = job->next) {
+      if (q->max > 0 && used > 0 && used + job->cpus > q->max)
+	break;
+      used += job->cpus;
+      demand += job->cpus;
+    }
+  }
+  return demand < s->cpus_total ? demand : s->cpus_total;
+}
+
+long
+sched_cpus_used(const struct sched *s)
+{
+  return s->cpus_used;
+}
+
+void
+sched_set_limit(struct sched *s, long cpus)
+/* Temporarily restrict the number of cpus used by jobs to CPUS.  Jobs
+ * which are already running are not affected.  */
+{
+  assert(cpus >= 1);
+  s->cpus_limit = cpus;
+}
+
+void
+sched_set_cpus(struct sched *s, long cpus)
+/* Change the number of available cpus.  If there are fewer cpus than
+ * the running jobs use, no new jobs start until enough have
+ * finished.  */
+{
+  assert(cpus >= 1);
+  s->cpus_total = cpus;
+  s->cpus_limit = cpus;
+}
+
+void
+sched_set_order(struct sched *s, enum sched_order order)
+{
+  s->order = order;
+}
+
+void
+sched_add(struct sched *s, struct job *job)
+/* Append JOB to the queue of pending jobs named by 'job->queue_name'.
+ * Unknown queues are created on the fly, without a limit.  Jobs which
+ * cannot fit into the machine or their queue at all are trimmed down,
+ * so that they run on their own.  */
+{
+  struct queue *q;
+  long  cpus = s->cpus_total;
+
+  job->queue = job->queue_name ? find_queue(s, job->queue_name, 1) : 0;
+  q = s->queues[job->queue];
+  if (q->max > 0 && q->max < cpus)
+    cpus = q->max;
+  if (job->cpus > cpus) {
+    warning("warning: job %ld needs %ld cpus, only %ld available",
+	    job->cmd_no, job->cpus, cpus);
+    job->cpus = cpus;
+  }
+  if (job->mem > s->mem_total) {
+    warning("warning: job %ld needs %llu bytes of memory,"
+	    " only %llu available", job->cmd_no, job->mem, s->mem_total);
+    job->mem = s->mem_total;
+  }
+
+  job->next = NULL;
+  *q->tail = job;
+  q->tail = &job->next;
+  ++q->n_pending;
+  ++s->n_pending;
+}
+
+static void
+sched_unlink(struct sched *s, struct queue *q, struct job **jpp)
+{
+  struct job *job = *jpp;
+
+  *jpp = job->next;
+  if (q->tail == &job->next)
+    q->tail = jpp;
+  job->next = NULL;
+  --q->n_pending;
+  --s->n_pending;
+}
+
+struct job *
+sched_remove(struct sched *s, long cmd_no)
+/* Remove the pending job with number CMD_NO from the queue, or the
+ * first pending job if CMD_NO is negative.  Return the job, or NULL if
+ * there is no such job.  */
+{
+  struct job **jpp, *job;
+  int  i;
+
+  for (i=0; i<s->n_queues; ++i) {
+    struct queue *q = s->queues[i];
+    for (jpp = &q->head; (job = *jpp); jpp = &job->next) {
+      if (cmd_no < 0 || job->cmd_no == cmd_no) {
+	sched_unlink(s, q, jpp);
+	return job;
+      }
+    }
+  }
+  return NULL;
+}
+
+static int
+sched_fits(const struct sched *s, const struct job *job)
+/* A job always fits into an empty machine, even if it needs more cpus
+ * than the current limit allows.  */
+{
+  long  cpus = s->cpus_limit < s->cpus_total ? s->cpus_limit : s->cpus_total;
+
+  return ((s->cpus_used == 0 || job->cpus <= cpus - s->cpus_used)
+	  && job->mem <= s->mem_total - s->mem_used);
+}
+
+static int
+queue_fits(const struct queue *q, const struct job *job)
+/* Like for the machine, a job always fits into an idle queue.  The cpus
+ * of a job are only trimmed to the limits when the job is added, and
+ * the limits may have been lowered since.  */
+{
+  return (q->max == 0 || q->cpus_used == 0
+	  || q->cpus_used + job->cpus <= q->max);
+}
+
+static struct job **
+queue_candidate(const struct sched *s, struct queue *q, int *blocked_p)
+/* Return the link to the job of Q which should run next, or NULL if
+ * none of the jobs in the look-ahead window fits.  If the first job
+ * has been overtaken too often, set *BLOCKED_P instead.  */
+{
+  struct job **jpp, **found = NULL, *job;
+  long  i;
+
+  for (jpp = &q->head, i = 0; (job = *jpp) && i < s->lookahead;
+       jpp = &job->next, ++i) {
+    if (queue_fits(q, job) && sched_fits(s, job)) {
+      if (! found || job->duration > (*found)->duration)
+	found = jpp;
+      if (s->order != order_LPT)
+	break;
+    } else if (i == 0 && job->passed >= s->lookahead
+	       && queue_fits(q, job)) {
+      *blocked_p = 1;
+      return NULL;
+    }
+  }
+  return found;
+}
+
+struct job *
+sched_next(struct sched *s)
+/* Remove the next job to run from the queues and reserve its
+ * resources.  Within a queue, jobs are considered in the order they
+ * were added; a job further back in the look-ahead window is allowed
+ * to overtake the jobs in front of it, if these do not fit into the
+ * free capacity.  With order_LPT, the longest job in the window which
+ * fits is chosen instead of the first one.  Once the first job in a
+ * queue has been overtaken 'lookahead' times, no other job is started
+ * until it has run.
+ * Among the queues which have a job ready, the one using the fewest
+ * cpus relative to its weight goes first.  Return NULL, if no pending
+ * job fits.  */
+{
+  struct job **best_jpp = NULL, **jpp, *job;
+  struct queue *best = NULL;
+  int  k, blocked = 0;
+  long  cpus = s->cpus_limit < s->cpus_total ? s->cpus_limit : s->cpus_total;
+
+  /* every job needs at least one cpu */
+  if (s->cpus_used > 0 && s->cpus_used >= cpus)
+    return NULL;
+
+  for (k=0; k<s->n_queues; ++k) {
+    struct queue *q = s->queues[k];
+
+    jpp = queue_candidate(s, q, &blocked);
+    if (blocked)
+      return NULL;
+    if (! jpp)
+      continue;
+    if (! best || q->cpus_used * best->weight < best->cpus_used * q->weight) {
+      best = q;
+      best_jpp = jpp;
+    }
+  }
+  if (! best)
+    return NULL;
+
+  job = *best_jpp;
+  for (k=0; k<s->n_queues; ++k) {
+    struct queue *q = s->queues[k];
+    /* a job held back by the limit of its own queue is not overtaken */
+    if (q->head && q->head != job && queue_fits(q, q->head)
+	&& ! sched_fits(s, q->head))
+      ++q->head->passed;
+  }
+
+  sched_unlink(s, best, best_jpp);
+  best->cpus_used += job->cpus;
+  s->cpus_used += job->cpus;
+  s->mem_used += job->mem;
+  return job;
+}
+
+void
+sched_release(struct sched *s, const struct job *job)
+/* Return the resources used by JOB to the pool.  */
+{
+  struct queue *q = s->queues[job->queue];
+
+  assert(s->cpus_used >= job->cpus && s->mem_used >= job->mem);
+  assert(q->cpus_used >= job->cpus);
+  q->cpus_used -= job->cpus;
+  s->cpus_used -= job->cpus;
+  s->mem_used -= job->mem;
+}
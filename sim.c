@@ -0,0 +1,395 @@
+/* sim.c - replay a command file on a simulated machine
+ *
+ * Copyright (C) 2009  Jochen Voss.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The simulator is a pool backend which does not start any processes.
+ * Every job "runs" for the time given by its 'time' annotation,
+ * measured on a virtual clock which jumps from one job completion to
+ * the next.  This allows to compare scheduling policies on a real
+ * workload in a fraction of a second.  */
+
+#ifdef HAVE_CONFIG_H
+#  include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+
+#include "parallel.h"
+
+
+/* If a policy with fewer slots comes within this factor of the
+ * makespan with all slots, the "auto-n" policy prefers it.  */
+#define AUTO_N_TOLERANCE 1.05
+
+struct event {
+  double  end;			/* virtual time when the job finishes */
+  pid_t  pid;
+  int  status;			/* wait status of the job */
+};
+
+struct sim {
+  double  now;
+  pid_t  last_pid;
+  struct event *heap;		/* pending completions, earliest first */
+  long  n_events, allocated;
+
+  /* the workload */
+  struct job *const *jobs;
+  long  n_jobs, next_job;
+
+  /* results */
+  double *latency;		/* completion time of every job */
+  long  n_done;
+  double  busy;			/* cpu-seconds used by the jobs */
+};
+
+struct sim_result {
+  long  slots;
+  double  makespan;
+  double  utilization;
+  double  p50, p95, p99;
+};
+
+
+/**********************************************************************
+ * the event queue
+ */
+
+static int
+event_before(const struct event *a, const struct event *b)
+{
+  return a->end < b->end || (a->end == b->end && a->pid < b->pid);
+}
+
+static void
+heap_up(struct sim *sim, long i)
+{
+  struct event  ev = sim->heap[i];
+
+  while (i > 0 && event_before(&ev, sim->heap + (i-1)/2)) {
+    sim->heap[i] = sim->heap[(i-1)/2];
+    i = (i-1)/2;
+  }
+  sim->heap[i] = ev;
+}
+
+static void
+heap_down(struct sim *sim, long i)
+{
+  struct event  ev = sim->heap[i];
+  long  n = sim->n_events;
+
+  for (;;) {
+    long  c = 2*i+1;
+    if (c >= n)
+      break;
+    if (c+1 < n && event_before(sim->heap+c+1, sim->heap+c))
+      ++c;
+    if (! event_before(sim->heap+c, &ev))
+      break;
+    sim->heap[i] = sim->heap[c];
+    i = c;
+  }
+  sim->heap[i] = ev;
+}
+
+
+/**********************************************************************
+ * the backend
+ */
+
+static int
+sim_start(struct job *job, void *data)
+{
+  struct sim *sim = data;
+  struct event *ev;
+
+  if (sim->n_events == sim->allocated) {
+    sim->allocated = sim->allocated ? 2*sim->allocated : 64;
+    sim->heap = xrenew(struct event, sim->heap, sim->allocated);
+  }
+  ev = sim->heap + sim->n_events++;
+  ev->end = sim->now + job->duration;
+  ev->pid = job->pid = ++sim->last_pid;
+  ev->status = 0;
+  heap_up(sim, sim->n_events-1);
+  sim->busy += job->duration * job->cpus;
+  return 0;
+}
+
+static void
+sim_signal(const struct job *job, int signum, void *data)
+/* SIGTERM and SIGKILL end a job at once, all other signals are
+ * ignored.  */
+{
+  struct sim *sim = data;
+  long  i;
+
+  if (signum != SIGTERM && signum != SIGKILL)
+    return;
+  for (i=0; i<sim->n_events; ++i) {
+    if (sim->heap[i].pid == job->pid) {
+      sim->heap[i].end = sim->now;
+      sim->heap[i].status = signum;
+      heap_up(sim, i);
+      break;
+    }
+  }
+}
+
+static pid_t
+sim_reap(const struct job *running, int *status_p, void *data)
+{
+  struct sim *sim = data;
+  pid_t  pid;
+
+  if (sim->n_events == 0 || sim->heap[0].end > sim->now)
+    return 0;
+  pid = sim->heap[0].pid;
+  *status_p = sim->heap[0].status;
+  sim->heap[0] = sim->heap[--sim->n_events];
+  if (sim->n_events > 0)
+    heap_down(sim, 0);
+  return pid;
+}
+
+static double
+sim_now(void *data)
+{
+  const struct sim *sim = data;
+
+  return sim->now;
+}
+
+static void
+sim_wait(double timeout, int fd, void *data)
+/* Advance the virtual clock to the next completion.  */
+{
+  struct sim *sim = data;
+  double  next;
+
+  if (sim->n_events > 0) {
+    next = sim->heap[0].end;
+    if (timeout >= 0 && sim->now + timeout < next)
+      next = sim->now + timeout;
+  } else {
+    next = sim->now + (timeout > 0 ? timeout : 0);
+  }
+  if (next > sim->now)
+    sim->now = next;
+}
+
+static const struct backend  sim_backend = {
+  sim_start, sim_signal, sim_reap, sim_now, sim_wait
+};
+
+
+/**********************************************************************
+ * running the simulation
+ */
+
+static struct job *
+sim_source(struct pool *pool, int *eof_p, void *data)
+/* Hand out copies of the jobs of the workload.  */
+{
+  struct sim *sim = data;
+  const struct job *tmpl;
+  struct job *job;
+
+  if (sim->next_job == sim->n_jobs) {
+    *eof_p = 1;
+    return NULL;
+  }
+  tmpl = sim->jobs[sim->next_job];
+  if (! pool_wants_more(pool, tmpl->queue_name))
+    return NULL;
+  ++sim->next_job;
+
+  job = new_job(tmpl->cmd_no, tmpl->cmd);
+  job->cpus = tmpl->cpus;
+  job->mem = tmpl->mem;
+  job->duration = tmpl->duration;
+  if (tmpl->queue_name)
+    job->queue_name = xstrdup(tmpl->queue_name);
+  return job;
+}
+
+static void
+sim_done(struct pool *pool, long id, int status, void *data)
+{
+  struct sim *sim = data;
+
+  sim->latency[sim->n_done++] = pool_now(pool);
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+  double  x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static double
+percentile(const double *sorted, long n, double p)
+{
+  long  i;
+
+  if (n == 0)
+    return 0;
+  i = (long)(p * n + 0.5) - 1;
+  if (i < 0)
+    i = 0;
+  if (i >= n)
+    i = n-1;
+  return sorted[i];
+}
+
+static int
+run_policy(struct job *const *jobs, long n_jobs,
+	   const struct pool_config *cfg, enum sched_order order,
+	   void (*setup)(struct pool *pool, void *data), void *setup_data,
+	   struct sim_result *res)
+/* Replay the workload once.  Return 0 on success and -1 on error.  */
+{
+  struct pool_config  c = *cfg;
+  struct sim  sim;
+  struct pool *pool;
+
+  c.cache_dir = NULL;
+  c.results_dir = NULL;
+  c.archive = NULL;
+  c.jobserver = "none";
+  c.suspend = NULL;
+  c.control = NULL;
+  c.verbosity = 0;
+  c.handle_signals = 0;
+  c.own_children = 0;
+  c.counters = 0;
+  c.speculate = 0;
+  c.heartbeat = NULL;
+  pool = new_pool(&c);
+  if (! pool)
+    return -1;
+
+  memset(&sim, 0, sizeof(sim));
+  sim.jobs = jobs;
+  sim.n_jobs = n_jobs;
+  sim.latency = xnew(double, n_jobs+1);
+  pool_set_backend(pool, &sim_backend, &sim);
+  pool_set_order(pool, order);
+  if (setup)
+    setup(pool, setup_data);
+  pool_set_source(pool, sim_source, &sim);
+  pool_set_callback(pool, sim_done, &sim);
+  pool_wait(pool);
+  delete_pool(pool);
+
+  qsort(sim.latency, sim.n_done, sizeof(double), compare_double);
+  res->slots = c.slots;
+  res->makespan = sim.now;
+  res->utilization = sim.now > 0 ? sim.busy / (c.slots * sim.now) : 1;
+  res->p50 = percentile(sim.latency, sim.n_done, 0.50);
+  res->p95 = percentile(sim.latency, sim.n_done, 0.95);
+  res->p99 = percentile(sim.latency, sim.n_done, 0.99);
+  xfree(sim.latency);
+  xfree(sim.heap);
+  return 0;
+}
+
+static void
+show_result(const char *policy, const struct sim_result *res)
+{
+  printf("%-10s %5ld %12.1f %7.1f%% %10.1f %10.1f %10.1f\n",
+	 policy, res->slots, res->makespan, 100 * res->utilization,
+	 res->p50, res->p95, res->p99);
+}
+
+int
+simulate(struct job *const *jobs, long n_jobs,
+	 const struct pool_config *cfg,
+	 void (*setup)(struct pool *pool, void *data), void *setup_data)
+/* Replay the jobs on a simulated machine described by CFG, using
+ * different scheduling policies, and print a report to stdout.  Job
+ * durations are taken from the 'time' annotations.  SETUP, if not
+ * NULL, is called for every new pool, e.g. to set up queues.  Return 0
+ * on success and -1 on error.  */
+{
+  struct pool_config  c = *cfg;
+  struct sim_result  res, full, best;
+  double  start;
+  long  lo, hi, n, i, runs = 3;
+
+  if (c.slots <= 0)
+    c.slots = sysconf(_SC_NPROCESSORS_CONF);
+  if (c.lookahead <= 0)
+    c.lookahead = 100;
+  start = current_time();
+
+  printf("%-10s %5s %12s %8s %10s %10s %10s\n", "policy", "slots",
+	 "makespan", "util", "p50", "p95", "p99");
+
+  /* without look-ahead, jobs start strictly in order */
+  c.lookahead = 1;
+  if (run_policy(jobs, n_jobs, &c, order_FIFO, setup, setup_data, &res) < 0)
+    return -1;
+  show_result("fifo", &res);
+  c.lookahead = cfg->lookahead > 0 ? cfg->lookahead : 100;
+
+  if (run_policy(jobs, n_jobs, &c, order_FIFO, setup, setup_data, &full) < 0)
+    return -1;
+  show_result("packing", &full);
+
+  if (run_policy(jobs, n_jobs, &c, order_LPT, setup, setup_data, &res) < 0)
+    return -1;
+  show_result("lpt", &res);
+
+  /* Bisect for the smallest number of slots which does (nearly) as
+   * well, assuming that the makespan decreases with the number of
+   * slots.  Jobs must not be trimmed down.  */
+  best = full;
+  for (lo=1, i=0; i<n_jobs; ++i) {
+    if (jobs[i]->cpus > lo)
+      lo = jobs[i]->cpus;
+  }
+  hi = c.slots;
+  while (lo < hi) {
+    struct pool_config  c2 = c;
+    c2.slots = n = (lo + hi) / 2;
+    ++runs;
+    if (run_policy(jobs, n_jobs, &c2, order_FIFO, setup, setup_data,
+		   &res) < 0)
+      return -1;
+    if (res.makespan <= AUTO_N_TOLERANCE * full.makespan) {
+      best = res;
+      hi = n;
+    } else {
+      lo = n+1;
+    }
+  }
+  show_result("auto-n", &best);
+
+  if (cfg->verbosity >= 2)
+    message("simulated %ld jobs %ld times in %.3f seconds",
+	    n_jobs, runs, current_time() - start);
+  return 0;
+}
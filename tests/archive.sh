@@ -0,0 +1,57 @@
+#! /bin/sh
+# archive.sh - store output in an archive and extract it again
+# Copyright 2009  Jochen Voss
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+
+# more than 256k, so that the record bypasses the batch
+seq 100000 > "$tmp/big"
+cat > "$tmp/cmds" <<EOF
+echo one
+echo two >&2; exit 3
+cat "$tmp/big"; echo big >&2
+cat "$tmp/big" >&2; exit 1
+EOF
+
+# extract ARCHIVE N OUT ERR STATUS - compare the record of command N
+extract () {
+  $PARALLEL --archive="$1" --extract="$2" > "$tmp/out" 2> "$tmp/err"
+  status=$?
+  printf "$3" | cmp -s - "$tmp/out" || {
+    echo "$1: wrong stdout for command $2"; exit 1; }
+  printf "$4" | cmp -s - "$tmp/err" || {
+    echo "$1: wrong stderr for command $2"; exit 1; }
+  test "$status" = "$5" || {
+    echo "$1: command $2 has status $status, expected $5"; exit 1; }
+}
+
+# check ARCHIVE - extract all records of the first run
+check () {
+  extract "$1" 1 'one\n' '' 0
+  extract "$1" 2 '' 'two\n' 3
+  extract "$1" 3 "$(cat "$tmp/big")\n" 'big\n' 0
+  extract "$1" 4 '' "$(cat "$tmp/big")\n" 1
+}
+
+for compress in "" --archive-compress; do
+  a="$tmp/a$compress.par"
+  $PARALLEL -n 2 --archive="$a" $compress -c "$tmp/cmds" 2>/dev/null
+  test $? = 1 || { echo "wrong exit status for $a"; exit 1; }
+  check "$a"
+
+  # the newer record of command 1 wins
+  echo 'echo again' | $PARALLEL --archive="$a" $compress 2>/dev/null \
+    || { echo "cannot append to $a"; exit 1; }
+  extract "$a" 1 'again\n' '' 0
+  extract "$a" 3 "$(cat "$tmp/big")\n" 'big\n' 0
+
+  # without the index, the records are found by scanning
+  size=$(wc -c < "$a")
+  head -c $((size - 24)) "$a" > "$tmp/cut.par"
+  extract "$tmp/cut.par" 1 'again\n' '' 0
+  extract "$tmp/cut.par" 4 '' "$(cat "$tmp/big")\n" 1
+done
+exit 0
@@ -0,0 +1,22 @@
+#! /bin/sh
+# basic.sh - run a few commands with the default settings
+# Copyright 2009  Jochen Voss
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+
+printf 'true\ntrue\ntrue\necho hello\n' > "$tmp/cmds"
+out=$($PARALLEL -n 2 -c "$tmp/cmds" 2>"$tmp/err") || {
+  echo "exit status $?, expected 0"; cat "$tmp/err"; exit 1; }
+test "$out" = hello || { echo "unexpected output \"$out\""; exit 1; }
+if grep -q terminating "$tmp/err"; then
+  echo "jobs were terminated:"; cat "$tmp/err"; exit 1
+fi
+
+printf 'true\nfalse\ntrue\n' > "$tmp/cmds"
+$PARALLEL -n 2 -c "$tmp/cmds" 2>/dev/null
+status=$?
+test $status = 1 || { echo "exit status $status with a failing job"; exit 1; }
+exit 0
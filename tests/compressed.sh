@@ -0,0 +1,27 @@
+#! /bin/sh
+# compressed.sh - damaged compressed command files make the run fail
+# Copyright 2009  Jochen Voss
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+gzip --version >/dev/null 2>&1 || exit 77
+
+i=0
+while [ $i -lt 20000 ]; do echo "true $i"; i=$((i+1)); done | gzip > "$tmp/cmds.gz"
+$PARALLEL -n 4 -c "$tmp/cmds.gz" >/dev/null 2>"$tmp/err"
+status=$?
+if [ $status = 1 ] && grep -q "not supported by this build" "$tmp/err"; then
+  exit 77
+fi
+test $status = 0 || { echo "intact file: exit status $status"; exit 1; }
+
+size=$(wc -c < "$tmp/cmds.gz")
+head -c $((size / 2)) "$tmp/cmds.gz" > "$tmp/short.gz"
+$PARALLEL -n 4 -c "$tmp/short.gz" >/dev/null 2>"$tmp/err"
+status=$?
+test $status = 2 || { echo "truncated file: exit status $status"; exit 1; }
+grep -q "truncated gzip data" "$tmp/err" || {
+  echo "no error message:"; tail "$tmp/err"; exit 1; }
+exit 0
@@ -0,0 +1,28 @@
+#! /bin/sh
+# heartbeat.sh - silent jobs are terminated, and retried if asked to
+# Copyright 2009  Jochen Voss
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+
+# the second job talks through a child process
+cat > "$tmp/cmds" <<'CMDS'
+sleep 30
+for i in 1 2 3 4; do echo $((i*25))% >&$PARALLEL_HEARTBEAT_FD; sleep 0.3; done
+sh -c 'for i in 1 2 3 4; do echo . >&$PARALLEL_HEARTBEAT_FD; sleep 0.3; done'
+CMDS
+$PARALLEL -n 3 --heartbeat=1 -c "$tmp/cmds" 2>"$tmp/err"
+status=$?
+test $status = 1 || { echo "exit status $status, expected 1"; exit 1; }
+n=$(grep -c "no heartbeat" "$tmp/err")
+test "$n" = 1 || { echo "$n jobs terminated, expected 1"; cat "$tmp/err"; exit 1; }
+
+# fails silently twice, then succeeds
+echo "n=\$(cat $tmp/count 2>/dev/null || echo 0); echo \$((n+1)) > $tmp/count; test \$n -ge 2 || sleep 30" \
+  > "$tmp/cmds"
+$PARALLEL --heartbeat=0.5,retry=2 -c "$tmp/cmds" 2>"$tmp/err" || {
+  echo "retried job failed"; cat "$tmp/err"; exit 1; }
+test "$(cat "$tmp/count")" = 3 || { echo "job ran $(cat "$tmp/count") times"; exit 1; }
+exit 0
@@ -0,0 +1,54 @@
+#! /bin/sh
+# sched.sh - check the order in which the scheduler starts jobs
+# Copyright 2009  Jochen Voss
+
+# The simulator runs the real scheduler on a virtual clock, so the
+# makespans and the completion times of these small workloads follow
+# from the order in which sched.c picks the jobs.
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+
+# simulate FILE OPTIONS... - run --simulate on FILE
+simulate () {
+  file=$1
+  shift
+  $PARALLEL "$@" --simulate -c "$tmp/$file" > "$tmp/out" 2>/dev/null || {
+    echo "--simulate $* failed"; exit 1; }
+}
+
+# check POLICY COLUMN VALUE - compare one entry of the last table
+check () {
+  got=$(awk -v p="$1" -v c="$2" '$1 == p { print $c }' "$tmp/out")
+  test "$got" = "$3" || {
+    echo "$1: column $2 is \"$got\", expected $3"; cat "$tmp/out"; exit 1; }
+}
+
+# Packing order on 4 slots: while job 1 runs, job 2 does not fit.
+# Packing starts the first job which fits (job 3, done at 1), then
+# job 4 at 1 and job 2 at 4; the jobs finish at 1, 4, 8 and 9.  LPT
+# picks the longer job 4 first, so job 3 waits until 8.  Without look-
+# ahead, job 3 and job 4 wait for job 2.
+printf '%s\n' '#[time=4 cpus=3] true' '#[time=4 cpus=3] true' \
+  '#[time=1] true' '#[time=8] true' > "$tmp/pack"
+simulate pack -n 4
+check fifo 3 13.0
+check packing 3 9.0
+check packing 5 4.0
+check lpt 3 9.0
+check lpt 5 8.0
+
+# Starvation guard on 2 slots: job 2 needs both slots and is
+# overtaken by job 3 and job 4.  With a look-ahead of 2, it has then
+# waited long enough, and job 5 must not start at 10; job 2 runs from
+# 15 to 16 and job 5 ends at 26.  With a long look-ahead, job 2 is
+# overtaken by job 5 and job 6 as well and runs last, at 20.
+printf '%s\n' '#[time=10] true' '#[time=1 cpus=2] true' '#[time=5] true' \
+  '#[time=10] true' '#[time=10] true' '#[time=5] true' > "$tmp/starve"
+simulate starve -n 2 -l 2
+check packing 3 26.0
+simulate starve -n 2 -l 100
+check packing 3 21.0
+exit 0
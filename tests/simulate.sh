@@ -0,0 +1,24 @@
+#! /bin/sh
+# simulate.sh - check the makespans reported by --simulate
+# Copyright 2009  Jochen Voss
+
+PARALLEL=${PARALLEL:-./parallel}
+tmp=${TMPDIR:-/tmp}/parallel-test.$$
+trap 'rm -rf "$tmp"' 0
+mkdir "$tmp" || exit 99
+
+printf '#[time=10] true\n#[time=5 cpus=2] true\n#[time=3] true\n' \
+  > "$tmp/cmds"
+$PARALLEL -n 2 --simulate -c "$tmp/cmds" > "$tmp/out" 2>/dev/null || {
+  echo "--simulate failed"; exit 1; }
+
+# policy slots makespan ...
+check () {
+  got=$(awk -v p="$1" '$1 == p { print $3 }' "$tmp/out")
+  test "$got" = "$2" || {
+    echo "$1: makespan \"$got\", expected $2"; cat "$tmp/out"; exit 1; }
+}
+check fifo 18.0
+check packing 15.0
+check lpt 15.0
+exit 0
@@ -0,0 +1,12 @@
+#! /bin/sh
+# symbols.sh - libparallel.a only exports the public API and prefixed names
+# Copyright 2009  Jochen Voss
+
+LIBPARALLEL=${LIBPARALLEL:-./libparallel.a}
+NM=${NM:-nm}
+$NM --version >/dev/null 2>&1 || exit 77
+
+bad=$($NM -g --defined-only "$LIBPARALLEL" | awk 'NF == 3 { print $3 }' \
+  | grep -v -e '^parallel_' -e '^pool_' -e '^new_pool$' -e '^delete_pool$')
+test -z "$bad" || { echo "unprefixed symbols:"; echo "$bad"; exit 1; }
+exit 0